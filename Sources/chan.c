@@ -23,6 +23,7 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -183,6 +184,23 @@ static void mill_choose_callback(struct mill_timer *timer) {
     mill_resume(cr, -1);
 }
 
+void mill_choose_cancel(struct mill_cr *cr) {
+    if(cr->state != MILL_CHR && cr->state != MILL_CHS &&
+          cr->state != MILL_CHOOSE)
+        return;
+    struct mill_slist_item *it;
+    for(it = mill_slist_begin(&cr->choosedata.clauses);
+        it; it = mill_slist_next(it)) {
+        struct mill_clause *itcl = mill_cont(it, struct mill_clause, chitem);
+        if(!itcl->used)
+            continue;
+        mill_list_erase(&itcl->ep->clauses, &itcl->epitem);
+    }
+    if(cr->choosedata.ddline)
+        mill_timer_rm(&cr->timer);
+    mill_resume(cr, -2);
+}
+
 void mill_choose_deadline(int64_t ddline) {
     if(mill_slow(mill_running->choosedata.othws ||
                  mill_running->choosedata.ddline))
@@ -191,7 +209,8 @@ void mill_choose_deadline(int64_t ddline) {
     /* Infinite deadline clause can never fire so we can as well ignore it. */
     if(ddline < 0)
         return;
-    mill_timer_add(&mill_running->timer, ddline, mill_choose_callback);
+    mill_timer_add(&mill_running->timer, mill_deadline_ns(ddline),
+        mill_running->slack, mill_choose_callback);
     mill_running->choosedata.ddline = 1;
 }
 
@@ -241,6 +260,9 @@ static void mill_dequeue(chan ch) {
     }
 }
 
+/* Returns index of the clause that was selected, -1 for the deadline or
+   'otherwise' clause, or MILL_CHOOSE_CANCELLED with errno set to ECANCELED
+   if the coroutine was cancelled. In the last case no clause was executed. */
 int mill_choose_wait(void) {
     struct mill_choosedata *cd = &mill_running->choosedata;
     struct mill_slist_item *it;
@@ -263,6 +285,8 @@ int mill_choose_wait(void) {
             mill_enqueue(ch);
         else
             mill_dequeue(ch);
+        if(cd->ddline)
+            mill_timer_rm(&mill_running->timer);
         mill_resume(mill_running, cl->idx);
         return mill_suspend();
     }
@@ -273,6 +297,15 @@ int mill_choose_wait(void) {
         return mill_suspend();
     }
 
+    /* Cancelled coroutine is not allowed to block any more. */
+    if(mill_slow(mill_running->cancelled)) {
+        if(cd->ddline)
+            mill_timer_rm(&mill_running->timer);
+        mill_running->state = MILL_READY;
+        errno = ECANCELED;
+        return MILL_CHOOSE_CANCELLED;
+    }
+
     /* In all other cases register this coroutine with the queried channels
        and wait till one of the clauses unblocks. */
     for(it = mill_slist_begin(&cd->clauses); it; it = mill_slist_next(it)) {
@@ -292,10 +325,15 @@ int mill_choose_wait(void) {
     }
     /* If there are multiple parallel chooses done from different coroutines
        all but one must be blocked on the following line. */
-    return mill_suspend();
+    int rc = mill_suspend();
+    if(mill_slow(rc == -2)) {
+        errno = ECANCELED;
+        return MILL_CHOOSE_CANCELLED;
+    }
+    return rc;
 }
 
-void mill_chs(chan ch, const char *current) {
+int mill_chs(chan ch, const char *current) {
     if(mill_slow(!ch))
         mill_panic("null channel used");
     mill_trace(current, "chs(<%d>)", (int)ch->debug.id);
@@ -303,10 +341,10 @@ void mill_chs(chan ch, const char *current) {
     mill_running->state = MILL_CHS;
     struct mill_clause cl;
     mill_choose_out(&cl, ch, 0);
-    mill_choose_wait();
+    return mill_choose_wait() < 0 ? -1 : 0;
 }
 
-void mill_chr(chan ch, const char *current) {
+int mill_chr(chan ch, const char *current) {
     if(mill_slow(!ch))
         mill_panic("null channel used");
     mill_trace(current, "chr(<%d>)", (int)ch->debug.id);
@@ -314,7 +352,7 @@ void mill_chr(chan ch, const char *current) {
     mill_choose_init_(current);
     struct mill_clause cl;
     mill_choose_in(&cl, ch, 0);
-    mill_choose_wait();
+    return mill_choose_wait() < 0 ? -1 : 0;
 }
 
 void mill_chdone(chan ch, const char *current) {
@@ -31,6 +31,8 @@
 #include "list.h"
 #include "slist.h"
 
+struct mill_cr;
+
 /* One of these structures is preallocated for every coroutine. */
 struct mill_choosedata {
     /* List of clauses in the 'choose' statement. */
@@ -43,6 +45,11 @@ struct mill_choosedata {
     int available;
 };
 
+/* Unblocks a coroutine blocked in mill_choose_wait(). The channels and the
+   deadline it waited for are released and mill_choose_wait() returns -1
+   with errno set to ECANCELED. */
+void mill_choose_cancel(struct mill_cr *cr);
+
 /* Channel endpoint. */
 struct mill_ep {
     /* Thanks to this flag we can cast from ep pointer to chan pointer. */
@@ -25,17 +25,30 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "cr.h"
 #include "debug.h"
 #include "libvenice.h"
 #include "poller.h"
 #include "stack.h"
+#include "sync.h"
 #include "utils.h"
 
 volatile int mill_unoptimisable1 = 1;
 volatile void *mill_unoptimisable2 = NULL;
 
+/* Handle of a coroutine started by cohandle(). */
+struct mill_handle {
+    /* The coroutine. NULL once it has finished. */
+    struct mill_cr *cr;
+    /* 1 if godetach() was called; the handle is freed once the coroutine
+       finishes. */
+    int detached;
+    /* The coroutine blocked in gojoin(), if any. */
+    struct mill_list joiners;
+};
+
 struct mill_cr mill_main = {0};
 struct mill_cr *mill_running = &mill_main;
 
@@ -93,6 +106,11 @@ void *mill_go_prologue(const char *created) {
     mill_preserve_debug();
     /* Allocate and initialise new stack. */
     struct mill_cr *cr = ((struct mill_cr*)mill_allocstack()) - 1;
+    mill_timer_init(&cr->timer);
+    cr->slack = 0;
+    cr->wg = NULL;
+    cr->handle = NULL;
+    cr->cancelled = 0;
     mill_register_cr(&cr->debug, created);
     mill_trace(created, "{%d}=go()", (int)cr->debug.id);
     /* Suspend the parent coroutine and make the new one running. */
@@ -106,7 +124,19 @@ void *mill_go_prologue(const char *created) {
 /* The final part of go(). Cleans up after the coroutine is finished. */
 void mill_go_epilogue(void) {
     mill_trace(NULL, "go() done");
+    /* Notify whoever is waiting for the coroutine to finish. */
+    if(mill_running->wg)
+        waitgroupdone(mill_running->wg);
+    struct mill_handle *h = mill_running->handle;
+    if(h) {
+        h->cr = NULL;
+        if(h->detached)
+            free(h);
+        else if(!mill_list_empty(&h->joiners))
+            mill_sync_wake(&h->joiners);
+    }
     mill_unregister_cr(&mill_running->debug);
+    mill_timer_term(&mill_running->timer);
     mill_freestack(mill_running + 1);
     mill_running = NULL;
     /* Given that there's no running coroutine at this point
@@ -123,9 +153,25 @@ void mill_yield(const char *current) {
     mill_suspend();
 }
 
-void co(void* ctx, void (*routine)(void*), const char *created) {
+/* Allows deadlines of the running coroutine to fire up to 'slack'
+   milliseconds late so that they can be coalesced with other timers.
+   Returns the previous value. */
+int64_t timerslack(int64_t slack) {
+    int64_t old = mill_running->slack / 1000000;
+    mill_running->slack = slack > 0 ? mill_deadline_ns(slack) : 0;
+    return old;
+}
+
+/* Starts a coroutine that notifies 'wg' and/or completes 'h' when it
+   finishes. */
+static void mill_co(void *ctx, void (*routine)(void*), struct mill_waitgroup *wg,
+      struct mill_handle *h, const char *created) {
     void *mill_sp = mill_go_prologue(created);
     if(mill_sp) {
+        mill_running->wg = wg;
+        mill_running->handle = h;
+        if(h)
+            h->cr = mill_running;
         int mill_anchor[mill_unoptimisable1];
         mill_unoptimisable2 = &mill_anchor;
         char mill_filler[(char*)&mill_anchor - (char*)(mill_sp)];
@@ -135,6 +181,72 @@ void co(void* ctx, void (*routine)(void*), const char *created) {
     }
 }
 
+void co(void* ctx, void (*routine)(void*), const char *created) {
+    mill_co(ctx, routine, NULL, NULL, created);
+}
+
+void cogroup(void *ctx, void (*routine)(void*), mwaitgroup wg,
+      const char *created) {
+    waitgroupadd(wg, 1);
+    mill_co(ctx, routine, wg, NULL, created);
+}
+
+mhandle cohandle(void *ctx, void (*routine)(void*), const char *created) {
+    struct mill_handle *h = malloc(sizeof(struct mill_handle));
+    if(!h) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    h->detached = 0;
+    mill_list_init(&h->joiners);
+    mill_co(ctx, routine, NULL, h, created);
+    return h;
+}
+
+int gojoin(mhandle h, int64_t deadline) {
+    if(mill_slow(!mill_list_empty(&h->joiners)))
+        mill_panic("coroutine is already being joined");
+    if(h->cr && mill_sync_wait(&h->joiners, 0, deadline) < 0)
+        return -1;
+    free(h);
+    return 0;
+}
+
+void godetach(mhandle h) {
+    if(mill_slow(!mill_list_empty(&h->joiners)))
+        mill_panic("attempt to detach a coroutine that is being joined");
+    if(!h->cr) {
+        free(h);
+        return;
+    }
+    h->detached = 1;
+}
+
+void gocancel(mhandle h) {
+    struct mill_cr *cr = h->cr;
+    if(!cr || cr->cancelled)
+        return;
+    cr->cancelled = 1;
+    /* If the coroutine is blocked, unblock it. Otherwise its next blocking
+       call will fail. */
+    switch(cr->state) {
+    case MILL_MSLEEP:
+    case MILL_FDWAIT:
+        mill_fdwait_cancel(cr);
+        break;
+    case MILL_CHR:
+    case MILL_CHS:
+    case MILL_CHOOSE:
+        mill_choose_cancel(cr);
+        break;
+    case MILL_SYNC:
+        mill_sync_interrupt(cr, ECANCELED);
+        break;
+    default:
+        break;
+    }
+}
+
 size_t mill_clauselen() {
     return MILL_CLAUSELEN;
 }
@@ -31,6 +31,7 @@
 #include "debug.h"
 #include "list.h"
 #include "slist.h"
+#include "sync.h"
 #include "timer.h"
 #include "utils.h"
 
@@ -40,7 +41,8 @@ enum mill_state {
     MILL_FDWAIT,
     MILL_CHR,
     MILL_CHS,
-    MILL_CHOOSE
+    MILL_CHOOSE,
+    MILL_SYNC
 };
 
 /* The coroutine. The memory layout looks like this:
@@ -64,10 +66,38 @@ struct mill_cr {
     /* If the coroutine is waiting for a deadline, it uses this timer. */
     struct mill_timer timer;
 
+    /* How late, in nanoseconds, the coroutine's deadlines may fire. */
+    int64_t slack;
+
+    /* Arguments of the fdwait() call the coroutine is blocked in. 'fd' is -1
+       if the coroutine is merely sleeping, 'deadline' is in nanoseconds or -1
+       if the timer is not armed. */
+    int fd;
+    int events;
+    int64_t deadline;
+
+    /* If the coroutine is waiting for a file descriptor, it is stored in its
+     lists of coroutines waiting for input and/or output. */
+    struct mill_list_item fdin;
+    struct mill_list_item fdout;
+
     /* This structure is used when the coroutine is executing a choose
      statement. */
     struct mill_choosedata choosedata;
 
+    /* This structure is used when the coroutine is blocked on a mutex,
+     rwlock, semaphore or condition variable. */
+    struct mill_syncdata syncdata;
+
+    /* Wait group to notify and handle to complete when the coroutine
+       finishes. Either may be NULL. */
+    struct mill_waitgroup *wg;
+    struct mill_handle *handle;
+
+    /* 1 if the coroutine was cancelled by gocancel(). All its subsequent
+       blocking calls fail with ECANCELED. */
+    int cancelled;
+
     /* Stored coroutine context while it is not executing. */
     struct mill_ctx ctx;
 
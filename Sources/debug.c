@@ -102,7 +102,10 @@ void goredump(void) {
                 sprintf(buf, "msleep()");
                 break;
             case MILL_FDWAIT:
-                sprintf(buf, "fdwait(%d)", -1);
+                sprintf(buf, "fdwait(%d)", cr->fd);
+                break;
+            case MILL_SYNC:
+                sprintf(buf, "sync()");
                 break;
             case MILL_CHR:
             case MILL_CHS:
@@ -49,7 +49,7 @@
 #include <stdio.h>		/* FILE fopen(3) fclose(3) getc(3) rewind(3) */
 #include <string.h>		/* memcpy(3) strlen(3) memmove(3) memchr(3) memcmp(3) strchr(3) strsep(3) strcspn(3) */
 #include <strings.h>		/* strcasecmp(3) strncasecmp(3) */
-#include <ctype.h>		/* isspace(3) isdigit(3) */
+#include <ctype.h>		/* isspace(3) isdigit(3) tolower(3) */
 #include <time.h>		/* time_t time(2) difftime(3) */
 #include <signal.h>		/* SIGPIPE sigemptyset(3) sigaddset(3) sigpending(2) sigprocmask(2) pthread_sigmask(3) sigtimedwait(2) */
 #include <errno.h>		/* errno EINVAL ENOENT */
@@ -3557,8 +3557,20 @@ struct dns_hosts {
 		_Bool alias;
 
 		struct dns_hosts_entry *next;
+
+		/* chains of the host and arpa indices */
+		struct dns_hosts_entry *hnext, *anext;
 	} *head, **tail;
 
+	/*
+	 * Hash indices over the entries, keyed by host name and by reverse
+	 * name. Chains preserve the order of the entries in the list, which
+	 * is the order of the hosts file. Aliases are not indexed by arpa,
+	 * as PTR queries never return them.
+	 */
+	struct dns_hosts_entry **byhost, **byarpa;
+	size_t nbuckets, count;
+
 	dns_atomic_t refcount;
 }; /* struct dns_hosts */
 
@@ -3596,6 +3608,8 @@ void dns_hosts_close(struct dns_hosts *hosts) {
 		free(ent);
 	}
 
+	free(hosts->byhost);
+	free(hosts->byarpa);
 	free(hosts);
 
 	return;
@@ -3745,10 +3759,71 @@ int dns_hosts_dump(struct dns_hosts *hosts, FILE *fp) {
 } /* dns_hosts_dump() */
 
 
+static size_t dns_hosts_hash(const char *name) {
+	size_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)tolower((unsigned char)*name++)) * 16777619U;
+
+	return h;
+} /* dns_hosts_hash() */
+
+
+static void dns_hosts_index(struct dns_hosts *hosts, struct dns_hosts_entry *ent) {
+	struct dns_hosts_entry **pos;
+
+	ent->hnext = 0;
+	ent->anext = 0;
+
+	for (pos = &hosts->byhost[dns_hosts_hash(ent->host) & (hosts->nbuckets - 1)]; *pos; pos = &(*pos)->hnext)
+		;;
+	*pos = ent;
+
+	if (ent->alias)
+		return;
+
+	for (pos = &hosts->byarpa[dns_hosts_hash(ent->arpa) & (hosts->nbuckets - 1)]; *pos; pos = &(*pos)->anext)
+		;;
+	*pos = ent;
+} /* dns_hosts_index() */
+
+
+static int dns_hosts_rehash(struct dns_hosts *hosts, size_t nbuckets) {
+	struct dns_hosts_entry **byhost, **byarpa, *ent;
+
+	if (!(byhost = calloc(nbuckets, sizeof *byhost)))
+		return dns_syerr();
+
+	if (!(byarpa = calloc(nbuckets, sizeof *byarpa))) {
+		free(byhost);
+
+		return dns_syerr();
+	}
+
+	free(hosts->byhost);
+	free(hosts->byarpa);
+
+	hosts->byhost	= byhost;
+	hosts->byarpa	= byarpa;
+	hosts->nbuckets	= nbuckets;
+
+	for (ent = hosts->head; ent; ent = ent->next)
+		dns_hosts_index(hosts, ent);
+
+	return 0;
+} /* dns_hosts_rehash() */
+
+
 int dns_hosts_insert(struct dns_hosts *hosts, int af, const void *addr, const void *host, _Bool alias) {
 	struct dns_hosts_entry *ent;
 	int error;
 
+	/* keep the load factor at or below one */
+	if (hosts->count >= hosts->nbuckets) {
+		if ((error = dns_hosts_rehash(hosts, hosts->nbuckets ? 2 * hosts->nbuckets : 64)) && !hosts->nbuckets)
+			return error;
+	}
+
 	if (!(ent = malloc(sizeof *ent)))
 		goto syerr;
 
@@ -3779,6 +3854,9 @@ int dns_hosts_insert(struct dns_hosts *hosts, int af, const void *addr, const vo
 	*hosts->tail	= ent;
 	hosts->tail	= &ent->next;
 
+	dns_hosts_index(hosts, ent);
+	hosts->count++;
+
 	return 0;
 syerr:
 	error	= dns_syerr();
@@ -3811,8 +3889,11 @@ struct dns_packet *dns_hosts_query(struct dns_hosts *hosts, struct dns_packet *Q
 
 	switch (rr.type) {
 	case DNS_T_PTR:
-		for (ent = hosts->head; ent; ent = ent->next) {
-			if (ent->alias || 0 != strcasecmp(qname, ent->arpa))
+		if (!hosts->nbuckets)
+			break;
+
+		for (ent = hosts->byarpa[dns_hosts_hash(qname) & (hosts->nbuckets - 1)]; ent; ent = ent->anext) {
+			if (0 != strcasecmp(qname, ent->arpa))
 				continue;
 
 			if ((error = dns_p_push(P, DNS_S_AN, qname, qlen, rr.type, rr.class, 0, ent->host)))
@@ -3827,7 +3908,10 @@ struct dns_packet *dns_hosts_query(struct dns_hosts *hosts, struct dns_packet *Q
 	case DNS_T_A:
 		af	= AF_INET;
 
-loop:		for (ent = hosts->head; ent; ent = ent->next) {
+loop:		if (!hosts->nbuckets)
+			break;
+
+		for (ent = hosts->byhost[dns_hosts_hash(qname) & (hosts->nbuckets - 1)]; ent; ent = ent->hnext) {
 			if (ent->af != af || 0 != strcasecmp(qname, ent->host))
 				continue;
 
@@ -7321,6 +7405,7 @@ struct dns_addrinfo {
 
 	int state;
 	int found;
+	unsigned ttl;
 
 	struct dns_stat st;
 }; /* struct dns_addrinfo */
@@ -7574,6 +7659,9 @@ exec:
 		switch (rr.type) {
 		case DNS_T_A:
 		case DNS_T_AAAA:
+			if (!ai->found || rr.ttl < ai->ttl)
+				ai->ttl = rr.ttl;
+
 			return dns_ai_setent(ent, &any, rr.type, ai);
 		default:
 			if (!dns_any_cname(ai->cname, sizeof ai->cname, &any, rr.type))
@@ -7613,6 +7701,9 @@ exec:
 		if ((error = dns_any_parse(&any, &rr, ai->glue)))
 			return error;
 
+		if (!ai->found || rr.ttl < ai->ttl)
+			ai->ttl = rr.ttl;
+
 		return dns_ai_setent(ent, &any, rr.type, ai);
 	case DNS_AI_S_SUBMIT_G:
 		if (dns_rr_grep(&rr, 1, dns_rr_i_new(ai->glue, .section = DNS_S_QD, .name = ai->g.name, .type = ai->g.type), ai->glue, &error))
@@ -7675,6 +7766,32 @@ exec:
 } /* dns_ai_nextent() */
 
 
+unsigned dns_ai_ttl(struct dns_addrinfo *ai) {
+	struct dns_rr rr;
+	struct dns_soa soa;
+	unsigned ttl;
+
+	if (ai->found)
+		return ai->ttl;
+
+	if (!ai->answer)
+		return 0;
+
+	/* Negative answers are cached for the lesser of the SOA TTL and the
+	 * SOA minimum field, see RFC 2308 section 5. */
+	dns_rr_foreach(&rr, ai->answer, .section = DNS_S_NS, .type = DNS_T_SOA) {
+		if (dns_soa_parse(&soa, &rr, ai->answer))
+			continue;
+
+		ttl = DNS_PP_MIN(rr.ttl, soa.minimum);
+
+		return ttl;
+	}
+
+	return 0;
+} /* dns_ai_ttl() */
+
+
 time_t dns_ai_elapsed(struct dns_addrinfo *ai) {
 	return (ai->res)? dns_res_elapsed(ai->res) : 0;
 } /* dns_ai_elapsed() */
@@ -1141,6 +1141,8 @@ void dns_ai_close(struct dns_addrinfo *);
 
 int dns_ai_nextent(struct addrinfo **, struct dns_addrinfo *);
 
+unsigned dns_ai_ttl(struct dns_addrinfo *);
+
 size_t dns_ai_print(void *, size_t, struct addrinfo *, struct dns_addrinfo *);
 
 time_t dns_ai_elapsed(struct dns_addrinfo *);
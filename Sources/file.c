@@ -22,31 +22,83 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "libvenice.h"
+#include "list.h"
+#include "offload.h"
+#include "sync.h"
 #include "utils.h"
 
+/* Default size of the input and output buffers. */
 #ifndef MILL_FILE_BUFLEN
 #define MILL_FILE_BUFLEN (4096)
 #endif
 
+/* Alignment of buffers, and granularity of their size, for files opened with
+   FILE_DIRECT. It has to be a multiple of the logical block size of the
+   underlying device. */
+#ifndef MILL_FILE_ALIGN
+#define MILL_FILE_ALIGN (4096)
+#endif
+
+/* Vectored positional I/O with at most this many buffers is done without
+   allocating a private copy of the buffer array. */
+#ifndef MILL_FILE_IOVLEN
+#define MILL_FILE_IOVLEN 16
+#endif
+
+/* Longest pause, in milliseconds, between two checks of whether prefetched
+   pages are already resident. */
+#ifndef MILL_FILE_PREFETCH_POLL
+#define MILL_FILE_PREFETCH_POLL 16
+#endif
+
+/* Prefetching gives up if no page became resident for this many
+   milliseconds. */
+#ifndef MILL_FILE_PREFETCH_STALL
+#define MILL_FILE_PREFETCH_STALL 1000
+#endif
+
 struct mill_file {
     int fd;
     size_t ifirst;
     size_t ilen;
     size_t olen;
-    char ibuf[MILL_FILE_BUFLEN];
-    char obuf[MILL_FILE_BUFLEN];
+    size_t buflen;
+    char *ibuf;
+    char *obuf;
     int eof;
+    /* Set if the page cache is bypassed. */
+    int direct;
     mode_t mode;
+    /* Group commit: number of completed syncs, whether one is in progress,
+       its result and coroutines waiting for it to finish. */
+    uint64_t syncs;
+    int syncing;
+    int syncerr;
+    struct mill_list syncwaiters;
+};
+
+/* Request to sync a file on a helper thread. */
+struct mill_filesyncjob {
+    struct mill_job job;
+    int fd;
+    int err;
 };
 
 static void mill_filetune(int fd) {
@@ -58,18 +110,56 @@ static void mill_filetune(int fd) {
     mill_assert(rc != -1);
 }
 
+/* Switches bypassing of the page cache on or off. */
+static int mill_filedirect(int fd, int direct) {
+#if defined O_DIRECT
+    int opt = fcntl(fd, F_GETFL, 0);
+    if(opt == -1)
+        return -1;
+    opt = direct ? opt | O_DIRECT : opt & ~O_DIRECT;
+    return fcntl(fd, F_SETFL, opt);
+#elif defined F_NOCACHE
+    return fcntl(fd, F_NOCACHE, direct ? 1 : 0);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
 
-mfile fileopen(const char *pathname, int flags, mode_t mode) {
-    /* Open the file. */
-    int fd = open(pathname, flags | O_NONBLOCK, mode);
-    if (fd == -1)
+static struct mill_file *mill_filemake(int fd, const struct stat *sb,
+      size_t buflen, int direct) {
+    if(!buflen)
+        buflen = MILL_FILE_BUFLEN;
+    if(direct) {
+        if(buflen > SIZE_MAX / 2 - MILL_FILE_ALIGN) {
+            errno = EINVAL;
+            return NULL;
+        }
+        buflen = (buflen + MILL_FILE_ALIGN - 1) & ~(size_t)(MILL_FILE_ALIGN - 1);
+        if(mill_filedirect(fd, 1) == -1)
+            return NULL;
+    }
+    else if(buflen > SIZE_MAX / 2) {
+        errno = EINVAL;
         return NULL;
-
-    /* Create the object. */
+    }
     struct mill_file *f = malloc(sizeof(struct mill_file));
     if(!f) {
-        fdclean(fd);
-        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Both buffers are allocated in a single chunk. With direct I/O the
+       transfers have to be aligned. */
+    void *bufs = NULL;
+    if(direct) {
+        if(posix_memalign(&bufs, MILL_FILE_ALIGN, buflen * 2) != 0)
+            bufs = NULL;
+    }
+    else {
+        bufs = malloc(buflen * 2);
+    }
+    if(!bufs) {
+        free(f);
         errno = ENOMEM;
         return NULL;
     }
@@ -77,31 +167,351 @@ mfile fileopen(const char *pathname, int flags, mode_t mode) {
     f->ifirst = 0;
     f->ilen = 0;
     f->olen = 0;
+    f->buflen = buflen;
+    f->ibuf = bufs;
+    f->obuf = f->ibuf + buflen;
     f->eof = 0;
-    struct stat sb;
-    if (fstat(f->fd, &sb) == -1)
+    f->direct = direct;
+    f->mode = sb->st_mode;
+    f->syncs = 0;
+    f->syncing = 0;
+    f->syncerr = 0;
+    mill_list_init(&f->syncwaiters);
+    return f;
+}
+
+static ssize_t mill_fileop(struct mill_file *f, int out,
+      const struct iovec *iov, int iovcnt, off_t offset) {
+    if(offset < 0)
+        return out ? writev(f->fd, iov, iovcnt) : readv(f->fd, iov, iovcnt);
+    return out ? pwritev(f->fd, iov, iovcnt, offset) :
+        preadv(f->fd, iov, iovcnt, offset);
+}
+
+static ssize_t mill_filecached(struct mill_file *f, int out,
+    const struct iovec *iov, int iovcnt, off_t offset);
+
+/* Transfers data at the given offset or, if negative, at the file offset.
+   With direct I/O the kernel refuses transfers that are not aligned, such
+   as the tail of the file or the data following it. Those go through the
+   page cache. */
+static ssize_t mill_fileiov(struct mill_file *f, int out,
+      const struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t sz = mill_fileop(f, out, iov, iovcnt, offset);
+    if(mill_fast(sz != -1 || errno != EINVAL || !f->direct))
+        return sz;
+    return mill_filecached(f, out, iov, iovcnt, offset);
+}
+
+/* Transfers data of a FILE_DIRECT file through the page cache. */
+static ssize_t mill_filecached(struct mill_file *f, int out,
+      const struct iovec *iov, int iovcnt, off_t offset) {
+    if(mill_filedirect(f->fd, 0) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t sz = mill_fileop(f, out, iov, iovcnt, offset);
+    int err = errno;
+    int rc = mill_filedirect(f->fd, 1);
+    mill_assert(rc != -1);
+    errno = err;
+    return sz;
+}
+
+static ssize_t mill_fileio(struct mill_file *f, int out, void *buf,
+      size_t len) {
+    struct iovec iov = {buf, len};
+    return mill_fileiov(f, out, &iov, 1, -1);
+}
+
+/* Metadata operation executed on a helper thread. Network filesystems may
+   take arbitrarily long to answer and blocking the scheduler meanwhile would
+   freeze all the coroutines. */
+struct mill_filemetajob {
+    struct mill_job job;
+    int flags;
+    mode_t mode;
+    int fd;
+    struct stat st;
+    char **names;
+    int err;
+    /* Second path, used by rename. Points into 'path'. */
+    char *path2;
+    char path[];
+};
+
+static struct mill_filemetajob *mill_filemetajob(
+      void (*fn)(struct mill_job *job), const char *path, const char *path2) {
+    size_t len = strlen(path) + 1;
+    size_t len2 = path2 ? strlen(path2) + 1 : 0;
+    struct mill_filemetajob *j = malloc(sizeof(struct mill_filemetajob) +
+        len + len2);
+    if(!j) {
+        errno = ENOMEM;
         return NULL;
-    f->mode = sb.st_mode;
+    }
+    j->job.fn = fn;
+    j->job.abandon = NULL;
+    j->fd = -1;
+    j->names = NULL;
+    j->err = 0;
+    memcpy(j->path, path, len);
+    j->path2 = NULL;
+    if(path2) {
+        j->path2 = j->path + len;
+        memcpy(j->path2, path2, len2);
+    }
+    return j;
+}
+
+/* Returns 0 on success, in which case the caller has to free the job.
+   Otherwise returns -1 with errno set and the job is freed. */
+static int mill_filemetarun(struct mill_filemetajob *j, int64_t deadline) {
+    if(mill_offload(&j->job, deadline) != 0)
+        return -1;
+    if(j->err) {
+        errno = j->err;
+        free(j);
+        return -1;
+    }
+    return 0;
+}
+
+static void mill_fileopen_fn(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    j->fd = open(j->path, j->flags, j->mode);
+    if(j->fd == -1) {
+        j->err = errno;
+        return;
+    }
+    if(fstat(j->fd, &j->st) == -1) {
+        j->err = errno;
+        close(j->fd);
+        j->fd = -1;
+    }
+}
+
+/* Nobody is interested in the file any more. */
+static void mill_fileopen_abandon(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    if(j->fd >= 0)
+        close(j->fd);
+}
+
+mfile fileopen(const char *pathname, int flags, mode_t mode) {
+    return fileopenbuf(pathname, flags, mode, 0, 0, -1);
+}
+
+mfile fileopenbuf(const char *pathname, int flags, mode_t mode,
+      size_t buflen, int opts, int64_t deadline) {
+    /* Open the file. */
+    struct mill_filemetajob *j = mill_filemetajob(mill_fileopen_fn,
+        pathname, NULL);
+    if(!j)
+        return NULL;
+    j->job.abandon = mill_fileopen_abandon;
+    j->flags = flags | O_NONBLOCK;
+    j->mode = mode;
+    if(mill_filemetarun(j, deadline) != 0)
+        return NULL;
+    int fd = j->fd;
+    struct stat sb = j->st;
+    free(j);
+
+    /* Create the object. */
+    struct mill_file *f = mill_filemake(fd, &sb, buflen, opts & FILE_DIRECT);
+    if(!f) {
+        int err = errno;
+        fdclean(fd);
+        close(fd);
+        errno = err;
+        return NULL;
+    }
     errno = 0;
     return f;
 }
 
+static void mill_filestat_fn(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    if(stat(j->path, &j->st) == -1)
+        j->err = errno;
+}
+
+int filestat(const char *pathname, struct stat *st, int64_t deadline) {
+    struct mill_filemetajob *j = mill_filemetajob(mill_filestat_fn,
+        pathname, NULL);
+    if(!j)
+        return -1;
+    if(mill_filemetarun(j, deadline) != 0)
+        return -1;
+    *st = j->st;
+    free(j);
+    errno = 0;
+    return 0;
+}
+
+static void mill_filerename_fn(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    if(rename(j->path, j->path2) == -1)
+        j->err = errno;
+}
+
+int filerename(const char *oldpath, const char *newpath, int64_t deadline) {
+    struct mill_filemetajob *j = mill_filemetajob(mill_filerename_fn,
+        oldpath, newpath);
+    if(!j)
+        return -1;
+    if(mill_filemetarun(j, deadline) != 0)
+        return -1;
+    free(j);
+    errno = 0;
+    return 0;
+}
+
+static void mill_fileunlink_fn(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    if(unlink(j->path) == -1)
+        j->err = errno;
+}
+
+int fileunlink(const char *pathname, int64_t deadline) {
+    struct mill_filemetajob *j = mill_filemetajob(mill_fileunlink_fn,
+        pathname, NULL);
+    if(!j)
+        return -1;
+    if(mill_filemetarun(j, deadline) != 0)
+        return -1;
+    free(j);
+    errno = 0;
+    return 0;
+}
+
+static void mill_filereaddir_fn(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    DIR *dir = opendir(j->path);
+    if(!dir) {
+        j->err = errno;
+        return;
+    }
+    /* Collect the names, each terminated by zero, into a single buffer. */
+    char *buf = NULL;
+    size_t sz = 0;
+    size_t cap = 0;
+    size_t count = 0;
+    while(1) {
+        errno = 0;
+        struct dirent *e = readdir(dir);
+        if(!e) {
+            j->err = errno;
+            break;
+        }
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        size_t len = strlen(e->d_name) + 1;
+        if(sz + len > cap) {
+            size_t ncap = cap ? cap * 2 : 1024;
+            while(ncap < sz + len)
+                ncap *= 2;
+            char *nbuf = realloc(buf, ncap);
+            if(!nbuf) {
+                j->err = ENOMEM;
+                break;
+            }
+            buf = nbuf;
+            cap = ncap;
+        }
+        memcpy(buf + sz, e->d_name, len);
+        sz += len;
+        ++count;
+    }
+    closedir(dir);
+    if(j->err) {
+        free(buf);
+        return;
+    }
+    /* The array of pointers is followed by the names themselves so that the
+       user can deallocate everything with a single free(). */
+    j->names = malloc(sizeof(char*) * (count + 1) + sz);
+    if(!j->names) {
+        free(buf);
+        j->err = ENOMEM;
+        return;
+    }
+    char *pos = (char*)(j->names + count + 1);
+    if(sz)
+        memcpy(pos, buf, sz);
+    free(buf);
+    size_t i;
+    for(i = 0; i != count; ++i) {
+        j->names[i] = pos;
+        pos += strlen(pos) + 1;
+    }
+    j->names[count] = NULL;
+}
+
+static void mill_filereaddir_abandon(struct mill_job *job) {
+    struct mill_filemetajob *j = (struct mill_filemetajob*)job;
+    free(j->names);
+}
+
+char **filereaddir(const char *pathname, int64_t deadline) {
+    struct mill_filemetajob *j = mill_filemetajob(mill_filereaddir_fn,
+        pathname, NULL);
+    if(!j)
+        return NULL;
+    j->job.abandon = mill_filereaddir_abandon;
+    if(mill_filemetarun(j, deadline) != 0)
+        return NULL;
+    char **names = j->names;
+    free(j);
+    errno = 0;
+    return names;
+}
+
+static size_t mill_filewrite_direct(struct mill_file *f, const void *buf,
+      size_t len, int64_t deadline) {
+    const char *pos = buf;
+    size_t remaining = len;
+    while(remaining) {
+        size_t sz = f->buflen - f->olen;
+        if(sz > remaining)
+            sz = remaining;
+        memcpy(&f->obuf[f->olen], pos, sz);
+        f->olen += sz;
+        pos += sz;
+        remaining -= sz;
+        if(f->olen < f->buflen)
+            break;
+        /* The data are in the buffer already and will be written by
+           the next flush, so they count as written even on failure. */
+        fileflush(f, deadline);
+        if(errno != 0)
+            return len - remaining;
+    }
+    errno = 0;
+    return len;
+}
+
 size_t filewrite(mfile f, const void *buf, size_t len, int64_t deadline) {
     /* If it fits into the output buffer copy it there and be done. */
-    if(f->olen + len <= MILL_FILE_BUFLEN) {
+    if(f->olen + len <= f->buflen) {
         memcpy(&f->obuf[f->olen], buf, len);
         f->olen += len;
         errno = 0;
         return len;
     }
 
+    /* With direct I/O the data are written in full, aligned buffers. */
+    if(f->direct)
+        return mill_filewrite_direct(f, buf, len, deadline);
+
     /* If it doesn't fit, flush the output buffer first. */
     fileflush(f, deadline);
     if(errno != 0)
         return 0;
 
     /* Try to fit it into the buffer once again. */
-    if(f->olen + len <= MILL_FILE_BUFLEN) {
+    if(f->olen + len <= f->buflen) {
         memcpy(&f->obuf[f->olen], buf, len);
         f->olen += len;
         errno = 0;
@@ -113,7 +523,7 @@ size_t filewrite(mfile f, const void *buf, size_t len, int64_t deadline) {
     char *pos = (char*)buf;
     size_t remaining = len;
     while(remaining) {
-        ssize_t sz = write(f->fd, pos, remaining);
+        ssize_t sz = mill_fileio(f, 1, pos, remaining);
         if(sz == -1) {
             if(errno != EAGAIN && errno != EWOULDBLOCK)
                 return 0;
@@ -125,6 +535,8 @@ size_t filewrite(mfile f, const void *buf, size_t len, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return len - remaining;
             }
+            if(rc < 0)
+                return len - remaining;
             mill_assert(rc == FDW_OUT);
             continue;
         }
@@ -139,10 +551,16 @@ void fileflush(mfile f, int64_t deadline) {
         errno = 0;
         return;
     }
+    /* With direct I/O, writing the unaligned tail of the buffer would leave
+       the file offset unaligned and all the following direct transfers
+       would be refused. Instead, the tail is written through the page cache
+       without moving the file offset and is kept in the buffer. Once the
+       buffer fills up it gets overwritten by a full block. */
+    size_t tail = f->direct ? f->olen & (MILL_FILE_ALIGN - 1) : 0;
     char *pos = f->obuf;
-    size_t remaining = f->olen;
+    size_t remaining = f->olen - tail;
     while(remaining) {
-        ssize_t sz = write(f->fd, pos, remaining);
+        ssize_t sz = mill_fileio(f, 1, pos, remaining);
         if(sz == -1) {
             if(errno != EAGAIN && errno != EWOULDBLOCK)
                 return;
@@ -154,14 +572,98 @@ void fileflush(mfile f, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return;
             }
+            if(rc < 0)
+                return;
             mill_assert(rc == FDW_OUT);
             continue;
         }
         pos += sz;
         remaining -= sz;
     }
-    f->olen = 0;
+    if(tail) {
+        off_t offset = lseek(f->fd, 0, SEEK_CUR);
+        if(offset == -1)
+            return;
+        size_t done = 0;
+        while(done < tail) {
+            struct iovec iov = {pos + done, tail - done};
+            ssize_t sz = mill_filecached(f, 1, &iov, 1, offset + done);
+            if(sz == -1)
+                return;
+            done += sz;
+        }
+        memmove(f->obuf, pos, tail);
+    }
+    f->olen = tail;
+    errno = 0;
+}
+
+static void mill_filesync_fn(struct mill_job *job) {
+    struct mill_filesyncjob *s = (struct mill_filesyncjob*)job;
+#if defined __APPLE__
+    int rc = fsync(s->fd);
+#else
+    int rc = fdatasync(s->fd);
+#endif
+    s->err = rc == 0 ? 0 : errno;
+    close(s->fd);
+}
+
+int filesync(mfile f, int64_t deadline) {
+    fileflush(f, deadline);
+    if(errno != 0)
+        return -1;
+    /* The sync has to start after the data were written. If one is already
+       in progress it doesn't count, wait for the next one. All the
+       coroutines that arrive during a sync share the following one. */
+    uint64_t target = f->syncs + (f->syncing ? 2 : 1);
+    while(f->syncs < target) {
+        if(f->syncing) {
+            if(mill_sync_wait(&f->syncwaiters, 0, deadline) != 0)
+                return -1;
+            continue;
+        }
+        /* Nobody is syncing. Do it on behalf of everybody. The syscall may
+           take long so it's done on a helper thread. */
+        struct mill_filesyncjob *s = malloc(sizeof(struct mill_filesyncjob));
+        if(!s) {
+            errno = ENOMEM;
+            return -1;
+        }
+        s->job.fn = mill_filesync_fn;
+        s->job.abandon = NULL;
+        /* The job may outlive the mfile if the wait is cut short. Make sure
+           it doesn't end up syncing an unrelated file. */
+        s->fd = dup(f->fd);
+        if(s->fd == -1) {
+            int err = errno;
+            free(s);
+            errno = err;
+            return -1;
+        }
+        f->syncing = 1;
+        int rc = mill_offload(&s->job, deadline);
+        int err = errno;
+        f->syncing = 0;
+        if(rc == 0) {
+            f->syncerr = s->err;
+            ++f->syncs;
+            free(s);
+        }
+        /* Let the waiters either collect the result or take over. */
+        while(!mill_list_empty(&f->syncwaiters))
+            mill_sync_wake(&f->syncwaiters);
+        if(rc != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+    if(f->syncerr) {
+        errno = f->syncerr;
+        return -1;
+    }
     errno = 0;
+    return 0;
 }
 
 size_t fileread(mfile f, void *buf, size_t len, int64_t deadline) {
@@ -185,10 +687,10 @@ size_t fileread(mfile f, void *buf, size_t len, int64_t deadline) {
 
     mill_assert(remaining);
     while(1) {
-        if(remaining > MILL_FILE_BUFLEN) {
+        if(remaining > f->buflen && !f->direct) {
             /* If we still have a lot to read try to read it in one go directly
              into the destination buffer. */
-            ssize_t sz = read(f->fd, pos, remaining);
+            ssize_t sz = mill_fileio(f, 0, pos, remaining);
             if(!sz) {
                 f->eof = 1;
                 return len - remaining;
@@ -208,7 +710,7 @@ size_t fileread(mfile f, void *buf, size_t len, int64_t deadline) {
         else {
             /* If we have just a little to read try to read the full file
              buffer to minimise the number of system calls. */
-            ssize_t sz = read(f->fd, f->ibuf, MILL_FILE_BUFLEN);
+            ssize_t sz = mill_fileio(f, 0, f->ibuf, f->buflen);
             if(!sz) {
                 f->eof = 1;
                 return len - remaining;
@@ -242,6 +744,8 @@ size_t fileread(mfile f, void *buf, size_t len, int64_t deadline) {
             errno = ETIMEDOUT;
             return len - remaining;
         }
+        if(res < 0)
+            return len - remaining;
     }
 }
 
@@ -279,10 +783,10 @@ size_t filereadlh(mfile f, void *buf, size_t lowwater, size_t highwater, int64_t
 
     mill_assert(remaining);
     while(1) {
-        if(remaining > MILL_FILE_BUFLEN) {
+        if(remaining > f->buflen && !f->direct) {
             /* If we still have a lot to read try to read it in one go directly
              into the destination buffer. */
-            ssize_t sz = read(f->fd, pos, remaining);
+            ssize_t sz = mill_fileio(f, 0, pos, remaining);
             if(!sz) {
                 f->eof = 1;
                 return received;
@@ -303,7 +807,7 @@ size_t filereadlh(mfile f, void *buf, size_t lowwater, size_t highwater, int64_t
         else {
             /* If we have just a little to read try to read the full file
              buffer to minimise the number of system calls. */
-            ssize_t sz = read(f->fd, f->ibuf, MILL_FILE_BUFLEN);
+            ssize_t sz = mill_fileio(f, 0, f->ibuf, f->buflen);
             if(!sz) {
                 f->eof = 1;
                 return received;
@@ -345,6 +849,8 @@ size_t filereadlh(mfile f, void *buf, size_t lowwater, size_t highwater, int64_t
             errno = ETIMEDOUT;
             return received;
         }
+        if(res < 0)
+            return received;
     }
 }
 
@@ -353,27 +859,28 @@ void fileclose(mfile f) {
     fdclean(f->fd);
     int rc = close(f->fd);
     mill_assert(rc == 0);
+    free(f->ibuf);
     free(f);
     return;
 }
 
 mfile fileattach(int fd) {
-    struct mill_file *f = malloc(sizeof(struct mill_file));
-    if(!f) {
-        errno = ENOMEM;
+    struct stat sb;
+    if(fstat(fd, &sb) == -1)
+        return NULL;
+    struct mill_file *f = mill_filemake(fd, &sb, 0, 0);
+    if(!f)
         return NULL;
-    }
     mill_filetune(fd);
-    f->fd = fd;
-    f->ifirst = 0;
-    f->ilen = 0;
-    f->olen = 0;
     errno = 0;
     return f;
 }
 
 int filedetach(mfile f) {
     int fd = f->fd;
+    if(f->direct)
+        mill_filedirect(fd, 0);
+    free(f->ibuf);
     free(f);
     return fd;
 }
@@ -396,11 +903,244 @@ off_t filesize(mfile f) {
         return -1;
 
     off_t pos = lseek(f->fd, (size_t)0, SEEK_CUR);
-    size_t size = lseek(f->fd, (size_t)0, SEEK_END);
+    off_t size = lseek(f->fd, (size_t)0, SEEK_END);
     lseek(f->fd, pos, SEEK_SET);
+    /* In direct mode the buffered data may be on disk already, see
+       fileflush(). */
+    if(f->direct)
+        return size > pos + (off_t)f->olen ? size : pos + (off_t)f->olen;
     return size + f->olen;
 }
 
 int fileeof(mfile f) {
     return f->eof;
 }
+
+/* Transfers data at an explicit offset. Neither the file offset nor the
+   buffers are used or modified, so multiple coroutines can access different
+   parts of the same file concurrently. Data still sitting in the output
+   buffer are not visible to filepread(). A short count with errno set to 0
+   means that the end of the file was reached. 'iov' is modified in place. */
+static size_t mill_fileprw(mfile f, int out, struct iovec *iov, int iovcnt,
+      off_t offset, int64_t deadline) {
+    size_t done = 0;
+    while(iovcnt) {
+        ssize_t sz = mill_fileiov(f, out, iov, iovcnt, offset);
+        if(sz == -1) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return done;
+            /* If it's a regular file skip fdwait. */
+            if(S_ISREG(f->mode) || S_ISDIR(f->mode))
+                continue;
+            int rc = fdwait(f->fd, out ? FDW_OUT : FDW_IN, deadline);
+            if(rc == 0) {
+                errno = ETIMEDOUT;
+                return done;
+            }
+            if(rc < 0)
+                return done;
+            continue;
+        }
+        if(!sz)
+            break;
+        done += sz;
+        offset += sz;
+        /* Skip the buffers that were fully transferred and adjust the one
+           that was transferred partially. */
+        while(iovcnt && (size_t)sz >= iov->iov_len) {
+            sz -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt) {
+            iov->iov_base = (char*)iov->iov_base + sz;
+            iov->iov_len -= sz;
+        }
+    }
+    errno = 0;
+    return done;
+}
+
+static size_t mill_fileprwv(mfile f, int out, const struct iovec *iov,
+      int iovcnt, off_t offset, int64_t deadline) {
+    if(iovcnt < 0 || offset < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    struct iovec buf[MILL_FILE_IOVLEN];
+    struct iovec *v = buf;
+    if(iovcnt > MILL_FILE_IOVLEN) {
+        v = malloc(sizeof(struct iovec) * iovcnt);
+        if(!v) {
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+    memcpy(v, iov, sizeof(struct iovec) * iovcnt);
+    size_t sz = mill_fileprw(f, out, v, iovcnt, offset, deadline);
+    if(v != buf) {
+        int err = errno;
+        free(v);
+        errno = err;
+    }
+    return sz;
+}
+
+size_t filepread(mfile f, void *buf, size_t len, off_t offset,
+      int64_t deadline) {
+    if(offset < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    struct iovec iov = {buf, len};
+    return mill_fileprw(f, 0, &iov, 1, offset, deadline);
+}
+
+size_t filepwrite(mfile f, const void *buf, size_t len, off_t offset,
+      int64_t deadline) {
+    if(offset < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    struct iovec iov = {(void*)buf, len};
+    return mill_fileprw(f, 1, &iov, 1, offset, deadline);
+}
+
+size_t filepreadv(mfile f, const struct iovec *iov, int iovcnt, off_t offset,
+      int64_t deadline) {
+    return mill_fileprwv(f, 0, iov, iovcnt, offset, deadline);
+}
+
+size_t filepwritev(mfile f, const struct iovec *iov, int iovcnt,
+      off_t offset, int64_t deadline) {
+    return mill_fileprwv(f, 1, iov, iovcnt, offset, deadline);
+}
+
+/* Maps part of the file to memory, read-only. Data still sitting in the
+   output buffer are not visible through the mapping; use fileflush() first. */
+const void *filemap(mfile f, off_t offset, size_t len, int flags) {
+    if(offset < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* Zero length means 'till the end of the file'. Pages past the end of
+       the file can't be accessed, don't map them. */
+    struct stat sb;
+    if(fstat(f->fd, &sb) == -1)
+        return NULL;
+    if(sb.st_size <= offset || len > (size_t)(sb.st_size - offset)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if(!len)
+        len = sb.st_size - offset;
+    /* mmap() requires the offset to be page-aligned. Map from the beginning
+       of the page and return pointer into it. fileunmap() can reconstruct
+       the page address from the returned pointer. */
+    size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t shift = (size_t)(offset % pagesz);
+    char *base = mmap(NULL, len + shift, PROT_READ, MAP_SHARED, f->fd,
+        offset - shift);
+    if(base == MAP_FAILED)
+        return NULL;
+    /* The hints are advisory. Failure to apply them is not an error. */
+    if(flags & FILEMAP_SEQUENTIAL)
+        madvise(base, len + shift, MADV_SEQUENTIAL);
+    if(flags & FILEMAP_RANDOM)
+        madvise(base, len + shift, MADV_RANDOM);
+    if(flags & FILEMAP_WILLNEED)
+        madvise(base, len + shift, MADV_WILLNEED);
+    errno = 0;
+    return base + shift;
+}
+
+int fileunmap(const void *addr, size_t len) {
+    size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t shift = (size_t)((uintptr_t)addr % pagesz);
+    int rc = munmap((char*)addr - shift, len + shift);
+    if(rc != 0)
+        return -1;
+    errno = 0;
+    return 0;
+}
+
+/* Brings the pages of a mapped range into memory without blocking the
+   scheduler. Fails with EAGAIN if the pages stop arriving. */
+int fileprefetch(const void *addr, size_t len, int64_t deadline) {
+    if(!len) {
+        errno = 0;
+        return 0;
+    }
+    size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t shift = (size_t)((uintptr_t)addr % pagesz);
+    char *base = (char*)addr - shift;
+    size_t npages = (len + shift + pagesz - 1) / pagesz;
+    /* Touching a page that's not resident yet would block the whole
+       scheduler. Instead, ask the kernel to read the pages in the background,
+       check which of them have already arrived and sleep in between the
+       checks. */
+#if defined __linux__
+    unsigned char *vec = malloc(npages);
+#else
+    char *vec = malloc(npages);
+#endif
+    if(!vec) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* All the pages below this one are known to be resident. */
+    size_t first = 0;
+    int64_t pause = 1;
+    int64_t progress = now();
+    while(1) {
+        /* The kernel caps the amount of readahead done per request, so the
+           hint has to be repeated for whatever is still missing. */
+        if(madvise(base + first * pagesz, (npages - first) * pagesz,
+              MADV_WILLNEED) != 0 ||
+              mincore(base + first * pagesz, (npages - first) * pagesz,
+              vec) != 0) {
+            int err = errno;
+            free(vec);
+            errno = err;
+            return -1;
+        }
+        size_t i = 0;
+        while(first + i < npages && (vec[i] & 1))
+            ++i;
+        first += i;
+        if(first == npages)
+            break;
+        int64_t nw = now();
+        if(deadline >= 0 && nw >= deadline) {
+            free(vec);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        /* Some pages may never arrive, e.g. if the file was truncated or
+           they keep being evicted under memory pressure. Don't wait for
+           them forever. */
+        if(i)
+            progress = nw;
+        else if(nw - progress >= MILL_FILE_PREFETCH_STALL) {
+            free(vec);
+            errno = EAGAIN;
+            return -1;
+        }
+        int64_t wakeup = nw + pause;
+        if(deadline >= 0 && wakeup > deadline)
+            wakeup = deadline;
+        if(mill_fdwait(-1, 0, wakeup, "fileprefetch") < 0) {
+            int err = errno;
+            free(vec);
+            errno = err;
+            return -1;
+        }
+        if(pause < MILL_FILE_PREFETCH_POLL)
+            pause *= 2;
+    }
+    free(vec);
+    errno = 0;
+    return 0;
+}
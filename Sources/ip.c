@@ -29,11 +29,15 @@
 #endif
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #if !defined __sun
 #include <ifaddrs.h>
 #endif
@@ -43,8 +47,11 @@
 
 #include "dns.h"
 
+#include "cr.h"
 #include "ip.h"
 #include "libvenice.h"
+#include "list.h"
+#include "poller.h"
 #include "utils.h"
 
 MILL_CT_ASSERT(sizeof(ipaddr) >= sizeof(struct sockaddr_in));
@@ -53,7 +60,46 @@ MILL_CT_ASSERT(sizeof(ipaddr) >= sizeof(struct sockaddr_in6));
 static struct dns_resolv_conf *mill_dns_conf = NULL;
 static struct dns_hosts *mill_dns_hosts = NULL;
 static struct dns_hints *mill_dns_hints = NULL;
-static struct dns_resolver *mill_dns_resolver = NULL;
+
+/* Each query in progress uses its own resolver so that concurrent lookups
+ don't interfere with each other. Resolvers that are not in use are kept
+ here for later reuse. */
+#ifndef MILL_DNS_POOL_SIZE
+#define MILL_DNS_POOL_SIZE 16
+#endif
+
+static struct dns_resolver *mill_dns_pool[MILL_DNS_POOL_SIZE];
+static int mill_dns_npool = 0;
+
+/* Config files are checked for modification at most once per this many
+ milliseconds. If they've changed they are re-read. */
+#ifndef MILL_DNS_RELOAD
+#define MILL_DNS_RELOAD 5000
+#endif
+
+static const char *mill_dns_files[] = {
+    "/etc/resolv.conf",
+    "/etc/nsswitch.conf",
+    "/etc/hosts"
+};
+
+#define MILL_DNS_NFILES (sizeof(mill_dns_files) / sizeof(mill_dns_files[0]))
+
+/* What is used to tell whether a config file was modified. */
+struct mill_dnsstamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+};
+
+static struct mill_dnsstamp mill_dns_stamps[MILL_DNS_NFILES];
+static int64_t mill_dns_checked = 0;
+
+/* Incremented each time the config is re-read. Resolvers created from
+ an older config are not returned to the pool. */
+static unsigned mill_dns_gen = 0;
 
 static ipaddr mill_ipany(int port, int mode)
 {
@@ -249,101 +295,473 @@ ipaddr iplocal(const char *name, int port, int mode) {
 #endif
 }
 
-ipaddr ipremote(const char *name, int port, int mode, int64_t deadline) {
+/* Orders the resolved addresses according to 'mode'. If both address families
+ are acceptable they are interleaved, starting with the preferred one. */
+static int mill_ipsort(ipaddr *addrs, int naddrs, int mode,
+                       const ipaddr *ipv4, int nipv4,
+                       const ipaddr *ipv6, int nipv6) {
+    switch(mode) {
+        case IPADDR_IPV4:
+            nipv6 = 0;
+            break;
+        case IPADDR_IPV6:
+            nipv4 = 0;
+            break;
+        case 0:
+        case IPADDR_PREF_IPV4:
+        case IPADDR_PREF_IPV6:
+            break;
+        default:
+            mill_assert(0);
+    }
+    const ipaddr *first = ipv4;
+    const ipaddr *second = ipv6;
+    int nfirst = nipv4;
+    int nsecond = nipv6;
+    if(mode == IPADDR_PREF_IPV6) {
+        first = ipv6;
+        second = ipv4;
+        nfirst = nipv6;
+        nsecond = nipv4;
+    }
+    int n = 0;
+    int i = 0;
+    int j = 0;
+    while(n < naddrs && (i < nfirst || j < nsecond)) {
+        if(i < nfirst)
+            addrs[n++] = first[i++];
+        if(n < naddrs && j < nsecond)
+            addrs[n++] = second[j++];
+    }
+    return n;
+}
+
+/* Returns 1 if any of the config files was created, removed or modified
+ since the last call, 0 otherwise. */
+static int mill_dnsstat(void) {
+    int changed = 0;
+    size_t i;
+    for(i = 0; i != MILL_DNS_NFILES; ++i) {
+        struct mill_dnsstamp stamp;
+        memset(&stamp, 0, sizeof(stamp));
+        struct stat st;
+        if(stat(mill_dns_files[i], &st) == 0) {
+            stamp.dev = st.st_dev;
+            stamp.ino = st.st_ino;
+            stamp.size = st.st_size;
+            stamp.mtime = st.st_mtime;
+#if defined __APPLE__
+            stamp.mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+            stamp.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+        }
+        if(memcmp(&stamp, &mill_dns_stamps[i], sizeof(stamp)) != 0) {
+            mill_dns_stamps[i] = stamp;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+/* Loads DNS config files. Once loaded, they are re-read if they've changed
+ on disk. Queries in progress keep using the config they've started with. */
+static void mill_dnsinit(void) {
     int rc;
-    ipaddr addr = mill_ipliteral(name, port, mode);
-    if(errno == 0)
-        return addr;
-    /* Load DNS config files, unless they are already chached. */
-    if(mill_slow(!mill_dns_resolver)) {
-        /* TODO: Maybe re-read the configuration once in a while? */
-        mill_dns_conf = dns_resconf_local(&rc);
+    if(mill_fast(mill_dns_conf)) {
+        int64_t nw = now();
+        if(mill_fast(nw < mill_dns_checked + MILL_DNS_RELOAD))
+            return;
+        mill_dns_checked = nw;
+        if(!mill_dnsstat())
+            return;
+    }
+    else {
+        mill_dns_checked = now();
+        mill_dnsstat();
+    }
+    struct dns_resolv_conf *conf = dns_resconf_local(&rc);
+    struct dns_hosts *hosts = conf ? dns_hosts_local(&rc) : NULL;
+    struct dns_hints *hints = hosts ? dns_hints_local(conf, &rc) : NULL;
+    if(mill_slow(!hints)) {
+        /* The files may be in the middle of being rewritten. Keep using
+           the old config and try again at the next check. */
         mill_assert(mill_dns_conf);
-        mill_dns_hosts = dns_hosts_local(&rc);
-        mill_assert(mill_dns_hosts);
-        mill_dns_hints = dns_hints_local(mill_dns_conf, &rc);
-        mill_assert(mill_dns_hints);
-        mill_dns_resolver = dns_res_open(mill_dns_conf, mill_dns_hosts,
-                                         mill_dns_hints, NULL, dns_opts(), &rc);
-        mill_assert(mill_dns_resolver);
-    }
-    /* Let's do asynchronous DNS query here. */
-    mill_assert(port >= 0 && port <= 0xffff);
-    char portstr[8];
-    snprintf(portstr, sizeof(portstr), "%d", port);
+        if(hosts)
+            dns_hosts_close(hosts);
+        if(conf)
+            dns_resconf_close(conf);
+        memset(mill_dns_stamps, 0, sizeof(mill_dns_stamps));
+        return;
+    }
+    if(mill_dns_conf) {
+        dns_hints_close(mill_dns_hints);
+        dns_hosts_close(mill_dns_hosts);
+        dns_resconf_close(mill_dns_conf);
+        while(mill_dns_npool)
+            dns_res_close(mill_dns_pool[--mill_dns_npool]);
+        ++mill_dns_gen;
+    }
+    mill_dns_conf = conf;
+    mill_dns_hosts = hosts;
+    mill_dns_hints = hints;
+}
+
+/* Gets an idle resolver from the pool or creates a new one. 'gen' is set to
+ the generation of the config the resolver uses. */
+static struct dns_resolver *mill_dns_getres(unsigned *gen) {
+    mill_dnsinit();
+    *gen = mill_dns_gen;
+    if(mill_dns_npool)
+        return mill_dns_pool[--mill_dns_npool];
+    int rc;
+    struct dns_resolver *res = dns_res_open(mill_dns_conf, mill_dns_hosts,
+        mill_dns_hints, NULL, dns_opts(), &rc);
+    mill_assert(res);
+    return res;
+}
+
+/* Returns the resolver to the pool once the query is done. */
+static void mill_dns_putres(struct dns_resolver *res, unsigned gen) {
+    if(gen == mill_dns_gen && mill_dns_npool < MILL_DNS_POOL_SIZE) {
+        mill_dns_pool[mill_dns_npool++] = res;
+        return;
+    }
+    dns_res_close(res);
+}
+
+/* Resolves the name to addresses of the specified type, bypassing the cache.
+ Port numbers of the returned addresses are set to zero. Returns 0 on success,
+ EADDRNOTAVAIL if the name does not exist or has no addresses of the type,
+ ETIMEDOUT if the deadline expired, ECANCELED if the coroutine was cancelled
+ and EAGAIN in case of temporary failure. 'ttl' is set to number of seconds the result can be cached for. */
+static int mill_dnsquery(const char *name, enum dns_type type,
+                         int64_t deadline, ipaddr *addrs, int *naddrs,
+                         unsigned *ttl) {
+    int rc;
+    *naddrs = 0;
+    *ttl = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    struct dns_addrinfo *ai = dns_ai_open(name, portstr, DNS_T_A, &hints,
-                                          mill_dns_resolver, &rc);
+    hints.ai_family = type == DNS_T_AAAA ? PF_INET6 : PF_INET;
+    unsigned gen;
+    struct dns_resolver *res = mill_dns_getres(&gen);
+    struct dns_addrinfo *ai = dns_ai_open(name, "0", type, &hints, res, &rc);
     mill_assert(ai);
-    struct addrinfo *ipv4 = NULL;
-    struct addrinfo *ipv6 = NULL;
     struct addrinfo *it = NULL;
     while(1) {
         rc = dns_ai_nextent(&it, ai);
         if(rc == EAGAIN) {
             int fd = dns_ai_pollfd(ai);
             mill_assert(fd >= 0);
-            int events = fdwait(fd, FDW_IN, deadline);
+            /* Wake up at least once a second so that the resolver gets
+             a chance to retransmit the query or to give up. */
+            int64_t ddline = now() + 1000;
+            if(deadline >= 0 && deadline < ddline)
+                ddline = deadline;
+            int events = fdwait(fd,
+                dns_ai_events(ai) & POLLOUT ? FDW_OUT : FDW_IN, ddline);
             /* There's no guarantee that the file descriptor will be reused
              in next iteration. We have to clean the fdwait cache here
              to be on the safe side. */
             fdclean(fd);
-            if(mill_slow(!events)) {
-                errno = ETIMEDOUT;
-                return addr;
+            if(mill_slow((!events && ddline == deadline) || events < 0)) {
+                dns_ai_close(ai);
+                /* The resolver is in the middle of a query. Don't reuse it. */
+                dns_res_close(res);
+                return events < 0 ? ECANCELED : ETIMEDOUT;
             }
-            mill_assert(events == FDW_IN);
             continue;
         }
-        if(rc == ENOENT)
+        if(rc != 0)
             break;
-        if(!ipv4 && it && it->ai_family == AF_INET)
-            ipv4 = it;
-        if(!ipv6 && it && it->ai_family == AF_INET6)
-            ipv6 = it;
-        if(ipv4 && ipv6)
-            break;
-    }
-    switch(mode) {
-        case IPADDR_IPV4:
-            ipv6 = NULL;
-            break;
-        case IPADDR_IPV6:
-            ipv4 = NULL;
-            break;
-        case 0:
-        case IPADDR_PREF_IPV4:
-            if(ipv4)
-                ipv6 = NULL;
-            break;
-        case IPADDR_PREF_IPV6:
-            if(ipv6)
-                ipv4 = NULL;
-            break;
-        default:
-            mill_assert(0);
-    }
-    if(ipv4) {
-        struct sockaddr_in *inaddr = (struct sockaddr_in*)&addr;
-        memcpy(inaddr, ipv4->ai_addr, sizeof (struct sockaddr_in));
-        inaddr->sin_port = htons(port);
-        dns_ai_close(ai);
-        errno = 0;
-        return addr;
+        if(*naddrs < MILL_IPREMOTES_MAX &&
+              (it->ai_family == AF_INET || it->ai_family == AF_INET6)) {
+            memcpy(&addrs[*naddrs], it->ai_addr, it->ai_addrlen);
+            ++*naddrs;
+        }
+        free(it);
     }
-    if(ipv6) {
-        struct sockaddr_in6 *inaddr = (struct sockaddr_in6*)&addr;
-        memcpy(inaddr, ipv6->ai_addr, sizeof (struct sockaddr_in6));
-        inaddr->sin6_port = htons(port);
+    /* ENOENT means there are no more entries. DNS_ENONAME means that the
+     name doesn't exist. Anything else is a failure to get an answer. */
+    if(rc != ENOENT && rc != DNS_ENONAME) {
         dns_ai_close(ai);
-        errno = 0;
-        return addr;
+        dns_res_close(res);
+        return EAGAIN;
     }
+    *ttl = dns_ai_ttl(ai);
     dns_ai_close(ai);
-    ((struct sockaddr*)&addr)->sa_family = AF_UNSPEC;
-    errno = EADDRNOTAVAIL;
-    return addr;
+    mill_dns_putres(res, gen);
+    return *naddrs ? 0 : EADDRNOTAVAIL;
 }
 
+/* Cache of resolved names. The results of lookups are kept for the TTL of
+ the DNS records. Once expired, an entry is still served for MILL_DNS_STALE
+ milliseconds while it's being refreshed in the background. Concurrent
+ lookups of the same name share a single query. */
+
+#ifndef MILL_DNS_CACHE_BUCKETS
+#define MILL_DNS_CACHE_BUCKETS 256
+#endif
+
+#ifndef MILL_DNS_CACHE_SIZE
+#define MILL_DNS_CACHE_SIZE 1024
+#endif
+
+#ifndef MILL_DNS_STALE
+#define MILL_DNS_STALE 30000
+#endif
+
+struct mill_dnswaiter {
+    struct mill_list_item item;
+    struct mill_cr *cr;
+    /* Set once the result was stored and the waiter removed from the list. */
+    int done;
+    /* Where to store the result of the query. */
+    int err;
+    ipaddr *addrs;
+    int *naddrs;
+};
+
+struct mill_dnsentry {
+    /* Item in the hash table bucket. */
+    struct mill_list_item item;
+    /* Item in the list of all entries, most recently used first. */
+    struct mill_list_item lru;
+    char name[DNS_D_MAXNAME + 1];
+    enum dns_type type;
+    /* Result of the last query. Port numbers of the addresses are zero. */
+    int err;
+    int naddrs;
+    ipaddr addrs[MILL_IPREMOTES_MAX];
+    /* Time when the result expires and time until which the expired result
+       can be served while it is being refreshed. -1 if there is no result
+       yet. */
+    int64_t expiry;
+    int64_t stale;
+    /* 1 if there's a query in progress. */
+    int pending;
+    /* Coroutines waiting for the query in progress to finish. */
+    struct mill_list waiters;
+};
+
+static struct mill_list mill_dnscache[MILL_DNS_CACHE_BUCKETS];
+static struct mill_list mill_dnslru = {0};
+static int mill_dnscache_size = 0;
+
+static struct mill_list *mill_dnscache_bucket(const char *name,
+                                              enum dns_type type) {
+    /* FNV-1a hash of the lowercased name. */
+    uint32_t h = 2166136261u ^ (uint32_t)type;
+    for(; *name; ++name) {
+        h ^= (uint32_t)tolower((unsigned char)*name);
+        h *= 16777619u;
+    }
+    return &mill_dnscache[h % MILL_DNS_CACHE_BUCKETS];
+}
+
+/* Finds the cache entry for the name, creating a new one if needed. Returns
+ NULL if the entry can't be created. */
+static struct mill_dnsentry *mill_dnscache_get(const char *name,
+                                               enum dns_type type) {
+    if(mill_slow(strlen(name) > DNS_D_MAXNAME))
+        return NULL;
+    struct mill_list *bucket = mill_dnscache_bucket(name, type);
+    struct mill_list_item *it;
+    struct mill_dnsentry *e;
+    for(it = mill_list_begin(bucket); it; it = mill_list_next(it)) {
+        e = mill_cont(it, struct mill_dnsentry, item);
+        if(e->type == type && strcasecmp(e->name, name) == 0) {
+            mill_list_erase(&mill_dnslru, &e->lru);
+            mill_list_insert(&mill_dnslru, &e->lru,
+                mill_list_begin(&mill_dnslru));
+            return e;
+        }
+    }
+    /* Make room for the new entry by evicting least recently used entries
+       that are not being resolved at the moment. */
+    it = mill_dnslru.last;
+    while(it && mill_dnscache_size >= MILL_DNS_CACHE_SIZE) {
+        e = mill_cont(it, struct mill_dnsentry, lru);
+        it = it->prev;
+        if(e->pending)
+            continue;
+        mill_list_erase(&mill_dnslru, &e->lru);
+        mill_list_erase(mill_dnscache_bucket(e->name, e->type), &e->item);
+        free(e);
+        --mill_dnscache_size;
+    }
+    e = malloc(sizeof(struct mill_dnsentry));
+    if(mill_slow(!e))
+        return NULL;
+    strcpy(e->name, name);
+    e->type = type;
+    e->err = 0;
+    e->naddrs = 0;
+    e->expiry = -1;
+    e->stale = -1;
+    e->pending = 0;
+    mill_list_init(&e->waiters);
+    mill_list_insert(bucket, &e->item, NULL);
+    mill_list_insert(&mill_dnslru, &e->lru, mill_list_begin(&mill_dnslru));
+    ++mill_dnscache_size;
+    return e;
+}
+
+/* Coroutine that re-resolves the name of a cache entry. */
+static void mill_dnsrefresh(void *arg) {
+    struct mill_dnsentry *e = (struct mill_dnsentry*)arg;
+    ipaddr addrs[MILL_IPREMOTES_MAX];
+    int naddrs;
+    unsigned ttl;
+    int err = mill_dnsquery(e->name, e->type, -1, addrs, &naddrs, &ttl);
+    int64_t nw = now();
+    /* If the query failed, keep serving the old result for as long as
+       it is allowed to. Otherwise, store the new one. */
+    if(err != EAGAIN || e->expiry < 0 || nw >= e->stale) {
+        e->err = err;
+        e->naddrs = naddrs;
+        memcpy(e->addrs, addrs, naddrs * sizeof(ipaddr));
+        e->expiry = nw + (int64_t)ttl * 1000;
+        e->stale = e->expiry + (err == 0 && ttl ? MILL_DNS_STALE : 0);
+    }
+    e->pending = 0;
+    /* Hand the result to the coroutines waiting for it. */
+    while(!mill_list_empty(&e->waiters)) {
+        struct mill_dnswaiter *w = mill_cont(mill_list_begin(&e->waiters),
+            struct mill_dnswaiter, item);
+        mill_list_erase(&e->waiters, &w->item);
+        w->done = 1;
+        w->err = e->err;
+        *w->naddrs = e->naddrs;
+        memcpy(w->addrs, e->addrs, e->naddrs * sizeof(ipaddr));
+        mill_fdwait_interrupt(w->cr);
+    }
+}
+
+/* Starts a query for the cache entry unless it has a usable result or there's
+ a query in progress already. Returns 1 if the entry has no usable result,
+ 0 otherwise. */
+static int mill_dnsstart(struct mill_dnsentry *e) {
+    if(e->expiry >= 0 && now() < e->stale)
+        return 0;
+    if(!e->pending) {
+        e->pending = 1;
+        co(e, mill_dnsrefresh, "ipremote");
+    }
+    return 1;
+}
+
+/* Resolves the name to addresses of the specified type using the cache.
+ Return value is the same as with mill_dnsquery(). */
+static int mill_dnsresolve(const char *name, enum dns_type type,
+                           int64_t deadline, ipaddr *addrs, int *naddrs) {
+    struct mill_dnsentry *e = mill_dnscache_get(name, type);
+    if(mill_slow(!e)) {
+        unsigned ttl;
+        return mill_dnsquery(name, type, deadline, addrs, naddrs, &ttl);
+    }
+    if(mill_dnsstart(e)) {
+        /* There's no usable result. Wait for the query to finish. */
+        if(e->pending) {
+            struct mill_dnswaiter w;
+            w.cr = mill_running;
+            w.done = 0;
+            w.addrs = addrs;
+            w.naddrs = naddrs;
+            mill_list_insert(&e->waiters, &w.item, NULL);
+            int rc = fdwait(-1, 0, deadline);
+            /* The query may have finished after the timeout or the
+               cancellation made this coroutine ready, but before it got to
+               run. In that case the result is already here. */
+            if(w.done)
+                return w.err;
+            if(rc == 0 || (rc < 0 && errno == ECANCELED)) {
+                mill_list_erase(&e->waiters, &w.item);
+                *naddrs = 0;
+                return rc == 0 ? ETIMEDOUT : ECANCELED;
+            }
+            return w.err;
+        }
+    }
+    else if(now() >= e->expiry && !e->pending) {
+        /* The result is stale. Use it, but refresh it in the background. */
+        e->pending = 1;
+        co(e, mill_dnsrefresh, "ipremote");
+    }
+    *naddrs = e->naddrs;
+    memcpy(addrs, e->addrs, e->naddrs * sizeof(ipaddr));
+    return e->err;
+}
+
+static void mill_ipsetport(ipaddr *addr, int port) {
+    if(mill_ipfamily(*addr) == AF_INET)
+        ((struct sockaddr_in*)addr)->sin_port = htons((uint16_t)port);
+    else
+        ((struct sockaddr_in6*)addr)->sin6_port = htons((uint16_t)port);
+}
+
+int mill_ipremotes(const char *name, int port, int mode, int64_t deadline,
+                   ipaddr *addrs, int naddrs) {
+    mill_assert(naddrs > 0);
+    ipaddr addr = mill_ipliteral(name, port, mode);
+    if(errno == 0) {
+        addrs[0] = addr;
+        return 1;
+    }
+    mill_assert(port >= 0 && port <= 0xffff);
+    ipaddr ipv4[MILL_IPREMOTES_MAX];
+    ipaddr ipv6[MILL_IPREMOTES_MAX];
+    int nipv4 = 0;
+    int nipv6 = 0;
+    int rc4 = 0;
+    int rc6 = 0;
+    /* In dual-stack modes send both queries before waiting for either of
+       them. That way the lookup takes as long as the slower of the two
+       rather than the sum of both. */
+    if(mode != IPADDR_IPV4 && mode != IPADDR_IPV6) {
+        struct mill_dnsentry *e = mill_dnscache_get(name, DNS_T_A);
+        if(e)
+            mill_dnsstart(e);
+        e = mill_dnscache_get(name, DNS_T_AAAA);
+        if(e)
+            mill_dnsstart(e);
+    }
+    /* Collect the preferred family first. If it yields enough addresses
+       there's no need to wait for the other one. */
+    if(mode == IPADDR_IPV6 || mode == IPADDR_PREF_IPV6) {
+        rc6 = mill_dnsresolve(name, DNS_T_AAAA, deadline, ipv6, &nipv6);
+        if(mode != IPADDR_IPV6 && nipv6 < naddrs)
+            rc4 = mill_dnsresolve(name, DNS_T_A, deadline, ipv4, &nipv4);
+    }
+    else {
+        rc4 = mill_dnsresolve(name, DNS_T_A, deadline, ipv4, &nipv4);
+        if(mode != IPADDR_IPV4 && nipv4 < naddrs)
+            rc6 = mill_dnsresolve(name, DNS_T_AAAA, deadline, ipv6, &nipv6);
+    }
+    int i;
+    for(i = 0; i != nipv4; ++i)
+        mill_ipsetport(&ipv4[i], port);
+    for(i = 0; i != nipv6; ++i)
+        mill_ipsetport(&ipv6[i], port);
+    int n = mill_ipsort(addrs, naddrs, mode, ipv4, nipv4, ipv6, nipv6);
+    if(!n) {
+        if(rc4 == ECANCELED || rc6 == ECANCELED)
+            errno = ECANCELED;
+        else if(rc4 == ETIMEDOUT || rc6 == ETIMEDOUT)
+            errno = ETIMEDOUT;
+        else
+            errno = EADDRNOTAVAIL;
+        return 0;
+    }
+    errno = 0;
+    return n;
+}
+
+ipaddr ipremote(const char *name, int port, int mode, int64_t deadline) {
+    ipaddr addr;
+    int n = mill_ipremotes(name, port, mode, deadline, &addr, 1);
+    if(!n)
+        ((struct sockaddr*)&addr)->sa_family = AF_UNSPEC;
+    return addr;
+}
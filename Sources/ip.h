@@ -31,5 +31,16 @@ int mill_ipfamily(ipaddr addr);
 int mill_iplen(ipaddr addr);
 int mill_ipport(ipaddr addr);
 
+/* Maximum number of addresses of each family collected by mill_ipremotes(). */
+#ifndef MILL_IPREMOTES_MAX
+#define MILL_IPREMOTES_MAX 16
+#endif
+
+/* Resolves the name to up to 'naddrs' remote addresses, ordered according to
+   'mode'. Returns the number of addresses stored in 'addrs'. If it's zero,
+   errno is set to the reason of the failure. */
+int mill_ipremotes(const char *name, int port, int mode, int64_t deadline,
+                   ipaddr *addrs, int naddrs);
+
 #endif
 
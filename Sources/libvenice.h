@@ -33,6 +33,8 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /******************************************************************************/
 /*  ABI versioning support                                                    */
@@ -82,12 +84,20 @@
 /******************************************************************************/
 
 MILL_EXPORT int64_t now(void);
+MILL_EXPORT int64_t now_ns(void);
 
 /******************************************************************************/
 /*  Coroutines                                                                */
 /******************************************************************************/
 
 MILL_EXPORT void co(void* ctx, void (*routine)(void*), const char *created);
+
+typedef struct mill_handle *mhandle;
+
+MILL_EXPORT mhandle cohandle(void *ctx, void (*routine)(void*), const char *created);
+MILL_EXPORT int gojoin(mhandle h, int64_t deadline);
+MILL_EXPORT void godetach(mhandle h);
+MILL_EXPORT void gocancel(mhandle h);
 MILL_EXPORT size_t mill_clauselen();
 
 MILL_EXPORT void goprepare(int count, size_t stack_size);
@@ -100,11 +110,14 @@ MILL_EXPORT void mill_go_epilogue(void);
 
 MILL_EXPORT void mill_yield(const char *current);
 MILL_EXPORT void mill_msleep(int64_t deadline, const char *current);
+MILL_EXPORT void mill_msleep_ns(int64_t deadline, const char *current);
+MILL_EXPORT int64_t timerslack(int64_t slack);
 
 #define mill_string2(x) #x
 #define mill_string(x) mill_string2(x)
 
 #define fdwait(fd, events, deadline) mill_fdwait((fd), (events), (deadline), __FILE__ ":" mill_string(__LINE__))
+#define fdwait_ns(fd, events, deadline) mill_fdwait_ns((fd), (events), (deadline), __FILE__ ":" mill_string(__LINE__))
 
 MILL_EXPORT void fdclean(int fd);
 
@@ -113,9 +126,12 @@ MILL_EXPORT void fdclean(int fd);
 #define FDW_ERR 4
 
 MILL_EXPORT int mill_fdwait(int fd, int events, int64_t deadline, const char *current);
+MILL_EXPORT int mill_fdwait_ns(int fd, int events, int64_t deadline, const char *current);
 
 MILL_EXPORT pid_t mfork(void);
 MILL_EXPORT int mill_number_of_cores(void);
+MILL_EXPORT int prefork(int nworkers, void (*worker)(int idx, void *ctx), void *ctx);
+MILL_EXPORT int preforkwait(int64_t deadline);
 
 /******************************************************************************/
 /*  Channels                                                                  */
@@ -127,8 +143,8 @@ typedef struct mill_chan *chan;
     void *f5; int f6; int f7; int f8;}))
 
 MILL_EXPORT chan mill_chmake(size_t bufsz, const char *created);
-MILL_EXPORT void mill_chs(chan ch, const char *current);
-MILL_EXPORT void mill_chr(chan ch, const char *current);
+MILL_EXPORT int mill_chs(chan ch, const char *current);
+MILL_EXPORT int mill_chr(chan ch, const char *current);
 MILL_EXPORT void mill_chdone(chan ch, const char *current);
 MILL_EXPORT void mill_chclose(chan ch, const char *current);
 
@@ -138,8 +154,65 @@ MILL_EXPORT void mill_choose_out(void *clause, chan ch, int idx);
 MILL_EXPORT void mill_choose_otherwise(void);
 MILL_EXPORT int mill_choose_wait(void);
 
+#define MILL_CHOOSE_CANCELLED (-2)
+
 MILL_EXPORT void mill_panic(const char *text);
 
+/******************************************************************************/
+/*  Synchronisation                                                           */
+/******************************************************************************/
+
+typedef struct mill_mutex *mmutex;
+
+MILL_EXPORT mmutex mutexmake(void);
+MILL_EXPORT int mutexlock(mmutex m, int64_t deadline);
+MILL_EXPORT int mutextrylock(mmutex m);
+MILL_EXPORT void mutexunlock(mmutex m);
+MILL_EXPORT void mutexclose(mmutex m);
+
+typedef struct mill_rwlock *mrwlock;
+
+MILL_EXPORT mrwlock rwlockmake(void);
+MILL_EXPORT int rwlockrdlock(mrwlock l, int64_t deadline);
+MILL_EXPORT int rwlockwrlock(mrwlock l, int64_t deadline);
+MILL_EXPORT void rwlockunlock(mrwlock l);
+MILL_EXPORT void rwlockclose(mrwlock l);
+
+typedef struct mill_sem *msem;
+
+MILL_EXPORT msem semmake(int value);
+MILL_EXPORT int semacquire(msem s, int64_t deadline);
+MILL_EXPORT void semrelease(msem s);
+MILL_EXPORT void semclose(msem s);
+
+typedef struct mill_cond *mcond;
+
+MILL_EXPORT mcond condmake(void);
+MILL_EXPORT int condwait(mcond c, mmutex m, int64_t deadline);
+MILL_EXPORT void condsignal(mcond c);
+MILL_EXPORT void condbroadcast(mcond c);
+MILL_EXPORT void condclose(mcond c);
+
+typedef struct mill_waitgroup *mwaitgroup;
+
+MILL_EXPORT mwaitgroup waitgroupmake(void);
+MILL_EXPORT void waitgroupadd(mwaitgroup wg, int n);
+MILL_EXPORT void waitgroupdone(mwaitgroup wg);
+MILL_EXPORT int waitgroupwait(mwaitgroup wg, int64_t deadline);
+MILL_EXPORT void waitgroupclose(mwaitgroup wg);
+MILL_EXPORT void cogroup(void *ctx, void (*routine)(void*), mwaitgroup wg, const char *created);
+
+/******************************************************************************/
+/*  Shared-memory rings                                                       */
+/******************************************************************************/
+
+typedef struct mill_ring *mring;
+
+MILL_EXPORT mring ringmake(size_t itemsz, size_t capacity);
+MILL_EXPORT int ringsend(mring r, const void *item, int64_t deadline);
+MILL_EXPORT int ringrecv(mring r, void *item, int64_t deadline);
+MILL_EXPORT void ringclose(mring r);
+
 /******************************************************************************/
 /*  IP address library                                                        */
 /******************************************************************************/
@@ -167,6 +240,7 @@ MILL_EXPORT int tcpport(tcpsock s);
 MILL_EXPORT tcpsock tcpaccept(tcpsock s, int64_t deadline);
 MILL_EXPORT ipaddr tcpaddr(tcpsock s);
 MILL_EXPORT tcpsock tcpconnect(ipaddr addr, int64_t deadline);
+MILL_EXPORT tcpsock tcpconnect_name(const char *name, int port, int64_t deadline);
 MILL_EXPORT size_t tcpsend(tcpsock s, const void *buf, size_t len, int64_t deadline);
 MILL_EXPORT void tcpflush(tcpsock s, int64_t deadline);
 MILL_EXPORT size_t tcprecv(tcpsock s, void *buf, size_t len, int64_t deadline);
@@ -199,7 +273,7 @@ typedef struct mill_unixsock *unixsock;
 
 MILL_EXPORT unixsock unixlisten(const char *addr, int backlog);
 MILL_EXPORT unixsock unixaccept(unixsock s, int64_t deadline);
-MILL_EXPORT unixsock unixconnect(const char *addr);
+MILL_EXPORT unixsock unixconnect(const char *addr, int64_t deadline);
 MILL_EXPORT void unixpair(unixsock *a, unixsock *b);
 MILL_EXPORT size_t unixsend(unixsock s, const void *buf, size_t len,
                             int64_t deadline);
@@ -208,7 +282,27 @@ MILL_EXPORT size_t unixrecv(unixsock s, void *buf, size_t len,
                             int64_t deadline);
 MILL_EXPORT size_t unixrecvuntil(unixsock s, void *buf, size_t len,
                                  const char *delims, size_t delimcount, int64_t deadline);
+MILL_EXPORT int unixsendfd(unixsock s, int fd, int64_t deadline);
+MILL_EXPORT int unixsendfds(unixsock s, const int *fds, int nfds,
+                            int64_t deadline);
+MILL_EXPORT int unixrecvfd(unixsock s, int64_t deadline);
+MILL_EXPORT int unixrecvfds(unixsock s, int *fds, int maxfds,
+                            int64_t deadline);
 MILL_EXPORT void unixclose(unixsock s);
+
+#define UNIX_SEQPACKET 1
+#define UNIX_DGRAM 2
+
+MILL_EXPORT unixsock unixmsglisten(const char *addr, int type, int backlog);
+MILL_EXPORT unixsock unixmsgconnect(const char *addr, int type,
+                                    int64_t deadline);
+MILL_EXPORT void unixmsgpair(int type, unixsock *a, unixsock *b);
+MILL_EXPORT size_t unixsendmsg(unixsock s, const void *buf, size_t len,
+                               int64_t deadline);
+MILL_EXPORT size_t unixrecvmsg(unixsock s, void *buf, size_t len,
+                               int64_t deadline);
+MILL_EXPORT int unixrecvmmsg(unixsock s, const struct iovec *msgs,
+                             size_t *lens, int nmsgs, int64_t deadline);
 MILL_EXPORT unixsock unixattach(int fd, int listening);
 MILL_EXPORT int unixdetach(unixsock s);
 
@@ -217,9 +311,15 @@ MILL_EXPORT int unixdetach(unixsock s);
 /******************************************************************************/
 
 typedef struct mill_file *mfile;
+
+#define FILE_DIRECT 1
+
 MILL_EXPORT mfile fileopen(const char *pathname, int flags, mode_t mode);
+MILL_EXPORT mfile fileopenbuf(const char *pathname, int flags, mode_t mode,
+                              size_t buflen, int opts, int64_t deadline);
 MILL_EXPORT size_t filewrite(mfile f, const void *buf, size_t len, int64_t deadline);
 MILL_EXPORT void fileflush(mfile f, int64_t deadline);
+MILL_EXPORT int filesync(mfile f, int64_t deadline);
 MILL_EXPORT size_t fileread(mfile f, void *buf, size_t len, int64_t deadline);
 MILL_EXPORT size_t filereadlh(mfile f, void *buf, size_t lowwater, size_t highwater, int64_t deadline);
 MILL_EXPORT void fileclose(mfile f);
@@ -229,6 +329,22 @@ MILL_EXPORT off_t filetell(mfile f);
 MILL_EXPORT off_t fileseek(mfile f, off_t offset);
 MILL_EXPORT off_t filesize(mfile f);
 MILL_EXPORT int fileeof(mfile f);
+MILL_EXPORT int filestat(const char *pathname, struct stat *st, int64_t deadline);
+MILL_EXPORT int filerename(const char *oldpath, const char *newpath, int64_t deadline);
+MILL_EXPORT int fileunlink(const char *pathname, int64_t deadline);
+MILL_EXPORT char **filereaddir(const char *pathname, int64_t deadline);
+MILL_EXPORT size_t filepread(mfile f, void *buf, size_t len, off_t offset, int64_t deadline);
+MILL_EXPORT size_t filepwrite(mfile f, const void *buf, size_t len, off_t offset, int64_t deadline);
+MILL_EXPORT size_t filepreadv(mfile f, const struct iovec *iov, int iovcnt, off_t offset, int64_t deadline);
+MILL_EXPORT size_t filepwritev(mfile f, const struct iovec *iov, int iovcnt, off_t offset, int64_t deadline);
+
+#define FILEMAP_SEQUENTIAL 1
+#define FILEMAP_RANDOM 2
+#define FILEMAP_WILLNEED 4
+
+MILL_EXPORT const void *filemap(mfile f, off_t offset, size_t len, int flags);
+MILL_EXPORT int fileunmap(const void *addr, size_t len);
+MILL_EXPORT int fileprefetch(const void *addr, size_t len, int64_t deadline);
 
 /******************************************************************************/
 /*  Debugging                                                                 */
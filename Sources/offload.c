@@ -0,0 +1,243 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "cr.h"
+#include "libvenice.h"
+#include "offload.h"
+#include "utils.h"
+
+/* Maximum number of helper threads. They are started on demand and never
+   exit. */
+#ifndef MILL_OFFLOAD_THREADS
+#define MILL_OFFLOAD_THREADS 4
+#endif
+
+#define MILL_JOB_QUEUED 0
+#define MILL_JOB_RUNNING 1
+#define MILL_JOB_DONE 2
+#define MILL_JOB_ABANDONED 3
+
+/* Jobs waiting for a helper thread. */
+static pthread_mutex_t mill_offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mill_offload_cond = PTHREAD_COND_INITIALIZER;
+static struct mill_job *mill_offload_first = NULL;
+static struct mill_job *mill_offload_last = NULL;
+static int mill_offload_queued = 0;
+static int mill_offload_threads = 0;
+static int mill_offload_idle = 0;
+/* Threads don't survive fork(). The process that owns the pool. */
+static pid_t mill_offload_pid = 0;
+
+/* The job notifies the waiting coroutine about its completion via this pair
+   of file descriptors. [0] is waited for, [1] is written to. On Linux both
+   are the same eventfd, elsewhere they are the two ends of a pipe. */
+static int mill_job_notifier(int fds[2]) {
+#if defined __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    fds[0] = fds[1] = fd;
+    return 0;
+#else
+    if(pipe(fds) != 0)
+        return -1;
+    int i;
+    for(i = 0; i != 2; ++i) {
+        int opt = fcntl(fds[i], F_GETFL, 0);
+        int rc = fcntl(fds[i], F_SETFL, (opt == -1 ? 0 : opt) | O_NONBLOCK);
+        mill_assert(rc != -1);
+        rc = fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        mill_assert(rc != -1);
+    }
+    return 0;
+#endif
+}
+
+static void mill_job_close(struct mill_job *job) {
+    close(job->fds[0]);
+    if(job->fds[1] != job->fds[0])
+        close(job->fds[1]);
+}
+
+static void *mill_offload_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&mill_offload_lock);
+    while(1) {
+        while(!mill_offload_first) {
+            ++mill_offload_idle;
+            pthread_cond_wait(&mill_offload_cond, &mill_offload_lock);
+            --mill_offload_idle;
+        }
+        struct mill_job *job = mill_offload_first;
+        mill_offload_first = job->next;
+        if(!mill_offload_first)
+            mill_offload_last = NULL;
+        --mill_offload_queued;
+        job->state = MILL_JOB_RUNNING;
+        pthread_mutex_unlock(&mill_offload_lock);
+        job->fn(job);
+        pthread_mutex_lock(&mill_offload_lock);
+        if(job->state == MILL_JOB_ABANDONED) {
+            pthread_mutex_unlock(&mill_offload_lock);
+            if(job->abandon)
+                job->abandon(job);
+            mill_job_close(job);
+            free(job);
+            pthread_mutex_lock(&mill_offload_lock);
+            continue;
+        }
+        job->state = MILL_JOB_DONE;
+        uint64_t one = 1;
+        ssize_t sz = write(job->fds[1], &one, sizeof(one));
+        mill_assert(sz == sizeof(one));
+    }
+    return NULL;
+}
+
+/* Must be called with the lock held. */
+static int mill_offload_spawn(void) {
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+    if(rc != 0)
+        return rc;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* Signals should be delivered to the scheduler thread. Helper threads
+       inherit the signal mask so block everything while creating them. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    rc = pthread_create(&thread, &attr, mill_offload_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if(rc == 0)
+        ++mill_offload_threads;
+    return rc;
+}
+
+int mill_offload(struct mill_job *job, int64_t deadline) {
+    /* Cancelled coroutine is not allowed to block any more. */
+    if(mill_slow(mill_running->cancelled)) {
+        free(job);
+        errno = ECANCELED;
+        return -1;
+    }
+    if(mill_job_notifier(job->fds) != 0) {
+        int err = errno;
+        free(job);
+        errno = err;
+        return -1;
+    }
+    /* In a forked child the pool is empty. State of the parent's threads,
+       including the lock, is meaningless here. */
+    pid_t pid = getpid();
+    if(mill_slow(mill_offload_pid != pid)) {
+        pthread_mutex_init(&mill_offload_lock, NULL);
+        pthread_cond_init(&mill_offload_cond, NULL);
+        mill_offload_first = NULL;
+        mill_offload_last = NULL;
+        mill_offload_queued = 0;
+        mill_offload_threads = 0;
+        mill_offload_idle = 0;
+        mill_offload_pid = pid;
+    }
+    /* Enqueue the job and make sure there's a thread to pick it up. Idle
+       threads that were already signalled may not have dequeued their jobs
+       yet, so compare against the queue length. */
+    pthread_mutex_lock(&mill_offload_lock);
+    if(mill_offload_queued >= mill_offload_idle &&
+          mill_offload_threads < MILL_OFFLOAD_THREADS) {
+        int rc = mill_offload_spawn();
+        if(rc != 0 && !mill_offload_threads) {
+            pthread_mutex_unlock(&mill_offload_lock);
+            mill_job_close(job);
+            free(job);
+            errno = rc;
+            return -1;
+        }
+    }
+    job->state = MILL_JOB_QUEUED;
+    job->next = NULL;
+    if(mill_offload_last)
+        mill_offload_last->next = job;
+    else
+        mill_offload_first = job;
+    mill_offload_last = job;
+    ++mill_offload_queued;
+    pthread_cond_signal(&mill_offload_cond);
+    pthread_mutex_unlock(&mill_offload_lock);
+    /* Wait for the job to finish. */
+    int rc = fdwait(job->fds[0], FDW_IN, deadline);
+    int err = rc == 0 ? ETIMEDOUT : errno;
+    fdclean(job->fds[0]);
+    pthread_mutex_lock(&mill_offload_lock);
+    /* The job may have finished even though the wait failed. */
+    if(job->state == MILL_JOB_DONE) {
+        pthread_mutex_unlock(&mill_offload_lock);
+        mill_job_close(job);
+        errno = 0;
+        return 0;
+    }
+    if(job->state == MILL_JOB_RUNNING) {
+        /* The helper thread will clean up once it's done. */
+        job->state = MILL_JOB_ABANDONED;
+        pthread_mutex_unlock(&mill_offload_lock);
+        errno = err;
+        return -1;
+    }
+    /* The job hasn't started yet. Remove it from the queue. */
+    mill_assert(job->state == MILL_JOB_QUEUED);
+    struct mill_job **it = &mill_offload_first;
+    struct mill_job *prev = NULL;
+    while(*it != job) {
+        prev = *it;
+        it = &(*it)->next;
+    }
+    *it = job->next;
+    if(mill_offload_last == job)
+        mill_offload_last = prev;
+    --mill_offload_queued;
+    pthread_mutex_unlock(&mill_offload_lock);
+    mill_job_close(job);
+    free(job);
+    errno = err;
+    return -1;
+}
@@ -0,0 +1,56 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+
+#ifndef MILL_OFFLOAD_INCLUDED
+#define MILL_OFFLOAD_INCLUDED
+
+#include <stdint.h>
+
+/* Blocking system calls, such as fsync() or stat() on a slow filesystem, can
+   be executed on a helper thread so that they don't freeze the scheduler.
+   The caller embeds this structure at the beginning of a block allocated by
+   malloc() that holds the arguments and results of the call. */
+struct mill_job {
+    /* Executed on the helper thread. */
+    void (*fn)(struct mill_job *job);
+    /* Executed on the helper thread once 'fn' is done, if the coroutine
+       stopped waiting for the job in the meantime. It can release resources
+       acquired by 'fn'. May be NULL. */
+    void (*abandon)(struct mill_job *job);
+    /* Private to offload.c. */
+    struct mill_job *next;
+    int state;
+    int fds[2];
+};
+
+/* Runs the job on a helper thread and blocks the running coroutine until it
+   is done. Returns 0 on success; the caller then owns the job again and is
+   responsible for freeing it. Otherwise, e.g. if the deadline (in
+   milliseconds) expires or the coroutine is cancelled, it returns -1 with
+   errno set. In that case the job is not waited for and the library frees
+   it, after it finishes if it was already started. */
+int mill_offload(struct mill_job *job, int64_t deadline);
+
+#endif
@@ -22,6 +22,7 @@
 
  */
 
+#include <errno.h>
 #include <stdint.h>
 #include <sys/param.h>
 
@@ -35,9 +36,9 @@
  mechanisms (poll, epoll, kqueue). */
 void mill_poller_init(void);
 static void mill_poller_add(int fd, int events);
-static void mill_poller_rm(int fd, int events);
+static void mill_poller_rm(struct mill_cr *cr);
 static void mill_poller_clean(int fd);
-static int mill_poller_wait(int timeout);
+static int mill_poller_wait(int64_t timeout);
 static pid_t mill_fork(void);
 
 /* If 1, mill_poller_init was already called. */
@@ -52,19 +53,42 @@ void mill_msleep(int64_t deadline, const char *current) {
     mill_fdwait(-1, 0, deadline, current);
 }
 
+void mill_msleep_ns(int64_t deadline, const char *current) {
+    mill_fdwait_ns(-1, 0, deadline, current);
+}
+
 static void mill_poller_callback(struct mill_timer *timer) {
-    mill_resume(mill_cont(timer, struct mill_cr, timer), -1);
+    struct mill_cr *cr = mill_cont(timer, struct mill_cr, timer);
+    /* The file descriptor may have fired in the same iteration of mill_wait()
+       and resumed the coroutine already. */
+    if(cr->state != MILL_FDWAIT && cr->state != MILL_MSLEEP)
+        return;
+    mill_resume(cr, -1);
 }
 
 int mill_fdwait(int fd, int events, int64_t deadline, const char *current) {
+    return mill_fdwait_ns(fd, events, mill_deadline_ns(deadline), current);
+}
+
+int mill_fdwait_ns(int fd, int events, int64_t deadline,
+      const char *current) {
     if(mill_slow(!mill_poller_initialised)) {
         mill_poller_init();
         mill_assert(errno == 0);
         mill_poller_initialised = 1;
     }
+    /* Cancelled coroutine is not allowed to block any more. */
+    if(mill_slow(mill_running->cancelled)) {
+        errno = ECANCELED;
+        return -1;
+    }
     /* If required, start waiting for the timeout. */
     if(deadline >= 0)
-        mill_timer_add(&mill_running->timer, deadline, mill_poller_callback);
+        mill_timer_add(&mill_running->timer, deadline, mill_running->slack,
+            mill_poller_callback);
+    mill_running->fd = fd;
+    mill_running->events = events;
+    mill_running->deadline = deadline;
     /* If required, start waiting for the file descriptor. */
     if(fd >= 0)
         mill_poller_add(fd, events);
@@ -78,12 +102,37 @@ int mill_fdwait(int fd, int events, int64_t deadline, const char *current) {
             mill_timer_rm(&mill_running->timer);
         return rc;
     }
+    /* Handle the interrupt or cancellation. Everything was already cleaned
+       up by mill_fdwait_stop(). */
+    if(rc < -1) {
+        errno = rc == -2 ? EINTR : ECANCELED;
+        return -1;
+    }
     /* Handle the timeout. Clean-up the pollset. */
     if(fd >= 0)
-        mill_poller_rm(fd, events);
+        mill_poller_rm(mill_running);
     return 0;
 }
 
+/* Resumes the coroutine blocked in mill_fdwait() with the result 'rc'. */
+static void mill_fdwait_stop(struct mill_cr *cr, int rc) {
+    if(cr->state != MILL_FDWAIT && cr->state != MILL_MSLEEP)
+        return;
+    if(cr->deadline >= 0)
+        mill_timer_rm(&cr->timer);
+    if(cr->fd >= 0)
+        mill_poller_rm(cr);
+    mill_resume(cr, rc);
+}
+
+void mill_fdwait_interrupt(struct mill_cr *cr) {
+    mill_fdwait_stop(cr, -2);
+}
+
+void mill_fdwait_cancel(struct mill_cr *cr) {
+    mill_fdwait_stop(cr, -3);
+}
+
 void fdclean(int fd) {
     if(mill_slow(!mill_poller_initialised)) {
         mill_poller_init();
@@ -101,7 +150,7 @@ void mill_wait(int block) {
     }
     while(1) {
         /* Compute timeout for the subsequent poll. */
-        int timeout = block ? mill_timer_next() : 0;
+        int64_t timeout = block ? mill_timer_next() : 0;
         /* Wait for events. */
         int fd_fired = mill_poller_wait(timeout);
         /* Fire all expired timers. */
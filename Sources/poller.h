@@ -25,6 +25,8 @@
 #ifndef MILL_POLLER_INCLUDED
 #define MILL_POLLER_INCLUDED
 
+struct mill_cr;
+
 void mill_poller_init(void);
 
 /* poller.c also implements mill_wait() and mill_fdwait() declared
@@ -35,5 +37,15 @@ void mill_poller_init(void);
  it will block until there's at least one event to process. */
 void mill_wait(int block);
 
+/* Wake up a coroutine blocked in mill_fdwait() or mill_msleep(). The pending
+ timer and pollset registration are cancelled and mill_fdwait() returns -1
+ with errno set to EINTR. If the coroutine is not blocked in either of those
+ functions the call does nothing. */
+void mill_fdwait_interrupt(struct mill_cr *cr);
+
+/* Same as mill_fdwait_interrupt() except that mill_fdwait() fails with
+ ECANCELED. */
+void mill_fdwait_cancel(struct mill_cr *cr);
+
 #endif
 
@@ -0,0 +1,356 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libvenice.h"
+#include "utils.h"
+
+/* Workers that exit sooner than this many milliseconds after they were
+   started are considered to be crash-looping and are restarted only after
+   the interval elapses. */
+#ifndef MILL_PREFORK_BACKOFF
+#define MILL_PREFORK_BACKOFF 1000
+#endif
+
+/* Seconds the workers are given to drain before they are killed. */
+#ifndef MILL_PREFORK_DRAIN
+#define MILL_PREFORK_DRAIN 30
+#endif
+
+/* A worker process as seen by the supervisor. */
+struct mill_worker {
+    pid_t pid;
+    /* Index of the worker slot, passed to the worker function. */
+    int idx;
+    /* Time the worker was started at. */
+    int64_t started;
+    /* 1 if the worker was asked to drain and won't be restarted. */
+    int retiring;
+    /* Time the retiring worker gets killed at if it's still around, -1 if
+       it was killed already or it's not retiring. */
+    int64_t killat;
+};
+
+/* A slot without a worker, waiting to get one. */
+struct mill_vacancy {
+    int idx;
+    /* Time to start the worker at. */
+    int64_t at;
+};
+
+static struct mill_worker *mill_workers = NULL;
+static int mill_nworkers = 0;
+static struct mill_vacancy *mill_vacancies = NULL;
+static int mill_nvacancies = 0;
+
+/* In the worker process, the self-pipe the drain request is signalled
+   through. -1 in any other process. */
+static int mill_drainfds[2] = {-1, -1};
+
+static void mill_prefork_handler(int signo) {
+    (void)signo;
+    int err = errno;
+    char c = 0;
+    ssize_t sz = write(mill_drainfds[1], &c, 1);
+    (void)sz;
+    errno = err;
+}
+
+/* Starts a worker in the slot 'idx'. Doesn't return in the worker process. */
+static int mill_prefork_spawn(int idx, void (*worker)(int idx, void *ctx),
+      void *ctx, const sigset_t *mask) {
+    struct mill_worker *w = realloc(mill_workers,
+        (mill_nworkers + 1) * sizeof(struct mill_worker));
+    if(!w) {
+        errno = ENOMEM;
+        return -1;
+    }
+    mill_workers = w;
+    /* Don't let the child write out what the parent has buffered. */
+    fflush(NULL);
+    pid_t pid = mfork();
+    if(pid < 0)
+        return -1;
+    if(pid > 0) {
+        w = &mill_workers[mill_nworkers++];
+        w->pid = pid;
+        w->idx = idx;
+        w->started = now();
+        w->retiring = 0;
+        w->killat = -1;
+        return 0;
+    }
+    /* This is the worker. Interruption from the terminal or a termination
+       request ask it to drain; the supervisor deals with the rest. */
+    free(mill_workers);
+    mill_workers = NULL;
+    mill_nworkers = 0;
+    free(mill_vacancies);
+    mill_vacancies = NULL;
+    mill_nvacancies = 0;
+    int rc = pipe(mill_drainfds);
+    mill_assert(rc == 0);
+    int i;
+    for(i = 0; i != 2; ++i) {
+        int opt = fcntl(mill_drainfds[i], F_GETFL, 0);
+        rc = fcntl(mill_drainfds[i], F_SETFL, (opt == -1 ? 0 : opt) | O_NONBLOCK);
+        mill_assert(rc != -1);
+        rc = fcntl(mill_drainfds[i], F_SETFD, FD_CLOEXEC);
+        mill_assert(rc != -1);
+    }
+    struct sigaction sa;
+    sa.sa_handler = mill_prefork_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    rc = sigaction(SIGTERM, &sa, NULL);
+    mill_assert(rc == 0);
+    rc = sigaction(SIGINT, &sa, NULL);
+    mill_assert(rc == 0);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGALRM, SIG_DFL);
+    rc = sigprocmask(SIG_SETMASK, mask, NULL);
+    mill_assert(rc == 0);
+    worker(idx, ctx);
+    exit(0);
+}
+
+/* Asks the worker to drain and schedules killing it if it doesn't. */
+static void mill_prefork_retire(struct mill_worker *w) {
+    if(w->retiring)
+        return;
+    w->retiring = 1;
+    w->killat = now() + MILL_PREFORK_DRAIN * 1000;
+    kill(w->pid, SIGTERM);
+}
+
+/* Remembers that the slot has to get a worker at the specified time. */
+static int mill_prefork_vacate(int idx, int64_t at) {
+    struct mill_vacancy *v = realloc(mill_vacancies,
+        (mill_nvacancies + 1) * sizeof(struct mill_vacancy));
+    if(!v) {
+        errno = ENOMEM;
+        return -1;
+    }
+    mill_vacancies = v;
+    mill_vacancies[mill_nvacancies].idx = idx;
+    mill_vacancies[mill_nvacancies].at = at;
+    ++mill_nvacancies;
+    return 0;
+}
+
+/* Starts a worker in the slot. If that fails, tries again later. */
+static void mill_prefork_fill(int idx, void (*worker)(int idx, void *ctx),
+      void *ctx, const sigset_t *mask) {
+    if(mill_prefork_spawn(idx, worker, ctx, mask) == 0)
+        return;
+    int rc = mill_prefork_vacate(idx, now() + MILL_PREFORK_BACKOFF);
+    mill_assert(rc == 0);
+}
+
+/* Does whatever is due: fills the vacant slots and kills the workers that
+   failed to drain in time. Then arms the timer for whatever is due next. */
+static void mill_prefork_timers(void (*worker)(int idx, void *ctx),
+      void *ctx, const sigset_t *mask) {
+    int64_t nw = now();
+    int64_t next = -1;
+    int i;
+    /* Filling a slot may add a vacancy. Process only the ones that are
+       there already. */
+    int n = mill_nvacancies;
+    for(i = 0; i != n;) {
+        struct mill_vacancy v = mill_vacancies[i];
+        if(v.at > nw) {
+            ++i;
+            continue;
+        }
+        mill_vacancies[i] = mill_vacancies[--n];
+        mill_vacancies[n] = mill_vacancies[--mill_nvacancies];
+        mill_prefork_fill(v.idx, worker, ctx, mask);
+    }
+    for(i = 0; i != mill_nvacancies; ++i)
+        if(next < 0 || mill_vacancies[i].at < next)
+            next = mill_vacancies[i].at;
+    for(i = 0; i != mill_nworkers; ++i) {
+        struct mill_worker *w = &mill_workers[i];
+        if(w->killat < 0)
+            continue;
+        if(w->killat <= nw) {
+            kill(w->pid, SIGKILL);
+            w->killat = -1;
+            continue;
+        }
+        if(next < 0 || w->killat < next)
+            next = w->killat;
+    }
+    /* SIGALRM will wake up the supervisor. */
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 0;
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+    if(next >= 0) {
+        int64_t ms = next > nw ? next - nw : 1;
+        it.it_value.tv_sec = ms / 1000;
+        it.it_value.tv_usec = (ms % 1000) * 1000;
+    }
+    int rc = setitimer(ITIMER_REAL, &it, NULL);
+    mill_assert(rc == 0);
+}
+
+/* Runs 'worker' in 'nworkers' processes (one per core if zero) and keeps
+   them running. A listener created before the call is shared by all the
+   workers; alternatively each worker can open its own listener with
+   'reuseport' set. Workers that die are restarted in the same slot. SIGHUP
+   replaces all the workers gracefully, SIGTERM and SIGINT drain them and
+   make the function return. Workers that don't finish draining within
+   MILL_PREFORK_DRAIN seconds are killed. It never returns in the workers;
+   they exit once the worker function returns. */
+int prefork(int nworkers, void (*worker)(int idx, void *ctx), void *ctx) {
+    if(nworkers <= 0)
+        nworkers = mill_number_of_cores();
+    /* Signals are processed synchronously by sigwait() below. Timed events
+       are driven by SIGALRM. */
+    sigset_t set, mask;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGALRM);
+    int rc = sigprocmask(SIG_BLOCK, &set, &mask);
+    if(rc != 0)
+        return -1;
+    int i;
+    for(i = 0; i != nworkers; ++i) {
+        if(mill_prefork_spawn(i, worker, ctx, &mask) != 0) {
+            int err = errno;
+            for(i = 0; i != mill_nworkers; ++i)
+                kill(mill_workers[i].pid, SIGKILL);
+            while(mill_nworkers && waitpid(-1, NULL, 0) > 0)
+                --mill_nworkers;
+            free(mill_workers);
+            mill_workers = NULL;
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            errno = err;
+            return -1;
+        }
+    }
+    int draining = 0;
+    while(!draining || mill_nworkers) {
+        int signo;
+        rc = sigwait(&set, &signo);
+        mill_assert(rc == 0);
+        switch(signo) {
+        case SIGCHLD:
+            while(1) {
+                pid_t pid = waitpid(-1, NULL, WNOHANG);
+                if(pid <= 0)
+                    break;
+                for(i = 0; i != mill_nworkers; ++i)
+                    if(mill_workers[i].pid == pid)
+                        break;
+                if(i == mill_nworkers)
+                    continue;
+                struct mill_worker w = mill_workers[i];
+                mill_workers[i] = mill_workers[--mill_nworkers];
+                if(draining || w.retiring)
+                    continue;
+                /* The worker died on its own. Replace it, but not sooner
+                   than MILL_PREFORK_BACKOFF after it was started. */
+                rc = mill_prefork_vacate(w.idx,
+                    w.started + MILL_PREFORK_BACKOFF);
+                mill_assert(rc == 0);
+            }
+            break;
+        case SIGHUP:
+            /* Graceful restart. Start fresh workers and let the old ones
+               drain. Vacant slots are filled straight away. */
+            if(draining)
+                break;
+            {
+                int n = mill_nworkers;
+                for(i = 0; i != n; ++i) {
+                    if(mill_workers[i].retiring)
+                        continue;
+                    mill_prefork_retire(&mill_workers[i]);
+                    mill_prefork_fill(mill_workers[i].idx, worker, ctx, &mask);
+                }
+                for(i = 0; i != mill_nvacancies; ++i)
+                    mill_vacancies[i].at = now();
+            }
+            break;
+        case SIGTERM:
+        case SIGINT:
+            /* Graceful shutdown. */
+            if(draining)
+                break;
+            draining = 1;
+            for(i = 0; i != mill_nworkers; ++i)
+                mill_prefork_retire(&mill_workers[i]);
+            mill_nvacancies = 0;
+            break;
+        case SIGALRM:
+            break;
+        }
+        mill_prefork_timers(worker, ctx, &mask);
+    }
+    struct itimerval it = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &it, NULL);
+    free(mill_workers);
+    mill_workers = NULL;
+    free(mill_vacancies);
+    mill_vacancies = NULL;
+    mill_nvacancies = 0;
+    rc = sigprocmask(SIG_SETMASK, &mask, NULL);
+    mill_assert(rc == 0);
+    errno = 0;
+    return 0;
+}
+
+/* Called from a worker, blocks until the supervisor asks it to drain. */
+int preforkwait(int64_t deadline) {
+    if(mill_drainfds[0] < 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int rc = fdwait(mill_drainfds[0], FDW_IN, deadline);
+    if(rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if(rc < 0)
+        return -1;
+    errno = 0;
+    return 0;
+}
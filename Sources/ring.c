@@ -0,0 +1,320 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "libvenice.h"
+#include "utils.h"
+
+/* Ring buffer shared between processes. It is created before mfork() so
+   that the memory mapping and the notification file descriptors are
+   inherited by the child processes. The queue itself is the bounded
+   multi-producer multi-consumer queue by Dmitry Vyukov: every cell carries
+   a sequence number which tells whether it is ready to be written to or
+   read from, so the producers and consumers only contend on the head and
+   tail counters. Blocking is done by waiting for a file descriptor which
+   is signalled only if there's somebody waiting. */
+
+#define MILL_RING_LINE 64
+
+/* The shared part of the ring. The cells follow the header. */
+struct mill_ringhdr {
+    /* Position of the next item to receive. */
+    size_t head;
+    char pad1[MILL_RING_LINE - sizeof(size_t)];
+    /* Position of the next item to send. */
+    size_t tail;
+    char pad2[MILL_RING_LINE - sizeof(size_t)];
+    /* Number of coroutines, in all processes, waiting to receive and to
+       send respectively. */
+    int rwaiters;
+    int swaiters;
+};
+
+struct mill_ringcell {
+    size_t seq;
+    char data[];
+};
+
+struct mill_ring {
+    struct mill_ringhdr *hdr;
+    char *cells;
+    size_t mapsz;
+    size_t itemsz;
+    size_t cellsz;
+    size_t mask;
+    /* Signalled when items respectively free space become available.
+       [0] is waited for, [1] is written to. On Linux both are the same
+       eventfd, elsewhere they are the two ends of a pipe. */
+    int rfds[2];
+    int sfds[2];
+};
+
+static int mill_ring_notifier(int fds[2]) {
+#if defined __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    fds[0] = fds[1] = fd;
+    return 0;
+#else
+    if(pipe(fds) != 0)
+        return -1;
+    int i;
+    for(i = 0; i != 2; ++i) {
+        int opt = fcntl(fds[i], F_GETFL, 0);
+        int rc = fcntl(fds[i], F_SETFL, (opt == -1 ? 0 : opt) | O_NONBLOCK);
+        mill_assert(rc != -1);
+        rc = fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        mill_assert(rc != -1);
+    }
+    return 0;
+#endif
+}
+
+static void mill_ring_closenotifier(int fds[2]) {
+    fdclean(fds[0]);
+    close(fds[0]);
+    if(fds[1] != fds[0])
+        close(fds[1]);
+}
+
+static void mill_ring_post(int fds[2]) {
+    /* If the pipe is full it is signalled already. */
+    uint64_t one = 1;
+    ssize_t sz = write(fds[1], &one, sizeof(one));
+    (void)sz;
+}
+
+static void mill_ring_drain(int fds[2]) {
+    char buf[64];
+    while(read(fds[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+static struct mill_ringcell *mill_ring_cell(struct mill_ring *r, size_t pos) {
+    return (struct mill_ringcell*)(r->cells + (pos & r->mask) * r->cellsz);
+}
+
+/* Returns 1 if the item was stored, 0 if the ring is full. */
+static int mill_ring_push(struct mill_ring *r, const void *item) {
+    size_t pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+    while(1) {
+        struct mill_ringcell *c = mill_ring_cell(r, pos);
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0) {
+            /* On failure 'pos' is updated to the current tail. */
+            if(__atomic_compare_exchange_n(&r->hdr->tail, &pos, pos + 1, 1,
+                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy(c->data, item, r->itemsz);
+                __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if(dif < 0) {
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Returns 1 if an item was retrieved, 0 if the ring is empty. */
+static int mill_ring_pop(struct mill_ring *r, void *item) {
+    size_t pos = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    while(1) {
+        struct mill_ringcell *c = mill_ring_cell(r, pos);
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(dif == 0) {
+            if(__atomic_compare_exchange_n(&r->hdr->head, &pos, pos + 1, 1,
+                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy(item, c->data, r->itemsz);
+                __atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if(dif < 0) {
+            return 0;
+        }
+        else {
+            pos = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Returns 1 if there's an item ready to be received. */
+static int mill_ring_ready(struct mill_ring *r) {
+    size_t pos = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    struct mill_ringcell *c = mill_ring_cell(r, pos);
+    return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* Returns 1 if there's no space to send an item to. */
+static int mill_ring_full(struct mill_ring *r) {
+    size_t pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+    struct mill_ringcell *c = mill_ring_cell(r, pos);
+    return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos;
+}
+
+mring ringmake(size_t itemsz, size_t capacity) {
+    if(!itemsz || !capacity || capacity > SIZE_MAX / 2 ||
+          itemsz > SIZE_MAX - sizeof(struct mill_ringcell) - sizeof(size_t)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t cap = 2;
+    while(cap < capacity)
+        cap *= 2;
+    size_t cellsz = (sizeof(struct mill_ringcell) + itemsz + sizeof(size_t) -
+        1) & ~(sizeof(size_t) - 1);
+    /* The whole ring has to fit into a single mapping. */
+    if(cap > (SIZE_MAX - sizeof(struct mill_ringhdr)) / cellsz) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct mill_ring *r = malloc(sizeof(struct mill_ring));
+    if(!r) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    r->itemsz = itemsz;
+    r->cellsz = cellsz;
+    r->mask = cap - 1;
+    r->mapsz = sizeof(struct mill_ringhdr) + cap * r->cellsz;
+    void *map = mmap(NULL, r->mapsz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANON, -1, 0);
+    if(map == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->hdr = (struct mill_ringhdr*)map;
+    r->cells = (char*)map + sizeof(struct mill_ringhdr);
+    /* Fresh anonymous mapping is zero-filled. */
+    size_t i;
+    for(i = 0; i != cap; ++i)
+        mill_ring_cell(r, i)->seq = i;
+    if(mill_ring_notifier(r->rfds) != 0) {
+        int err = errno;
+        munmap(map, r->mapsz);
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    if(mill_ring_notifier(r->sfds) != 0) {
+        int err = errno;
+        mill_ring_closenotifier(r->rfds);
+        munmap(map, r->mapsz);
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    errno = 0;
+    return r;
+}
+
+int ringsend(mring r, const void *item, int64_t deadline) {
+    while(!mill_ring_push(r, item)) {
+        /* Announce the waiter first and check again afterwards. That way
+           a consumer either sees the waiter or we see the free space. */
+        __atomic_add_fetch(&r->hdr->swaiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(mill_ring_push(r, item)) {
+            __atomic_sub_fetch(&r->hdr->swaiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        int rc = fdwait(r->sfds[0], FDW_IN, deadline);
+        __atomic_sub_fetch(&r->hdr->swaiters, 1, __ATOMIC_SEQ_CST);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc < 0)
+            return -1;
+        /* Only consume the notification if we are going to act on it.
+           Otherwise it may be the one meant for another waiter. */
+        mill_ring_drain(r->sfds);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->hdr->rwaiters, __ATOMIC_RELAXED))
+        mill_ring_post(r->rfds);
+    if(__atomic_load_n(&r->hdr->swaiters, __ATOMIC_RELAXED) &&
+          !mill_ring_full(r))
+        mill_ring_post(r->sfds);
+    errno = 0;
+    return 0;
+}
+
+int ringrecv(mring r, void *item, int64_t deadline) {
+    while(!mill_ring_pop(r, item)) {
+        __atomic_add_fetch(&r->hdr->rwaiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(mill_ring_pop(r, item)) {
+            __atomic_sub_fetch(&r->hdr->rwaiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        int rc = fdwait(r->rfds[0], FDW_IN, deadline);
+        __atomic_sub_fetch(&r->hdr->rwaiters, 1, __ATOMIC_SEQ_CST);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc < 0)
+            return -1;
+        /* Only consume the notification if we are going to act on it.
+           Otherwise it may be the one meant for another waiter. */
+        mill_ring_drain(r->rfds);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->hdr->swaiters, __ATOMIC_RELAXED))
+        mill_ring_post(r->sfds);
+    /* Draining the notifier may have swallowed the signal meant for another
+       waiting consumer. Pass it on if there's more to receive. */
+    if(__atomic_load_n(&r->hdr->rwaiters, __ATOMIC_RELAXED) &&
+          mill_ring_ready(r))
+        mill_ring_post(r->rfds);
+    errno = 0;
+    return 0;
+}
+
+void ringclose(mring r) {
+    mill_ring_closenotifier(r->rfds);
+    mill_ring_closenotifier(r->sfds);
+    int rc = munmap(r->hdr, r->mapsz);
+    mill_assert(rc == 0);
+    free(r);
+}
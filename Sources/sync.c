@@ -0,0 +1,374 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cr.h"
+#include "libvenice.h"
+#include "list.h"
+#include "sync.h"
+#include "timer.h"
+#include "utils.h"
+
+/* All the primitives below keep their blocked coroutines in a FIFO list and
+   hand the primitive over to the first waiter directly when it is released.
+   A released lock thus never becomes available to a coroutine that didn't
+   wait for it and the waiters can't starve. The uncontended paths never
+   switch to the scheduler. */
+
+struct mill_mutex {
+    /* 1 if the mutex is locked. */
+    int locked;
+    /* Coroutines waiting to lock the mutex. */
+    struct mill_list waiters;
+};
+
+struct mill_rwlock {
+    /* Number of readers holding the lock. */
+    int readers;
+    /* 1 if the lock is held by a writer. */
+    int writer;
+    /* Coroutines waiting for the lock, both readers and writers. */
+    struct mill_list waiters;
+};
+
+struct mill_sem {
+    /* Number of units that can be acquired without blocking. */
+    int value;
+    /* Coroutines waiting to acquire a unit. */
+    struct mill_list waiters;
+};
+
+struct mill_cond {
+    /* Coroutines waiting to be signalled. */
+    struct mill_list waiters;
+};
+
+struct mill_waitgroup {
+    /* Number of outstanding tasks. */
+    int count;
+    /* Coroutines waiting for the count to drop to zero. */
+    struct mill_list waiters;
+};
+
+void mill_sync_interrupt(struct mill_cr *cr, int err) {
+    if(cr->state != MILL_SYNC)
+        return;
+    if(err == ECANCELED && !cr->syncdata.cancellable)
+        return;
+    if(cr->deadline >= 0)
+        mill_timer_rm(&cr->timer);
+    mill_list_erase(cr->syncdata.waiters, &cr->syncdata.item);
+    mill_resume(cr, -err);
+}
+
+static void mill_sync_callback(struct mill_timer *timer) {
+    mill_sync_interrupt(mill_cont(timer, struct mill_cr, timer), ETIMEDOUT);
+}
+
+/* Implementation of mill_sync_wait() that optionally ignores cancellation. */
+static int mill_sync_wait_(struct mill_list *waiters, int write,
+      int64_t deadline, int cancellable) {
+    /* Cancelled coroutine is not allowed to block any more. */
+    if(mill_slow(cancellable && mill_running->cancelled)) {
+        errno = ECANCELED;
+        return -1;
+    }
+    deadline = mill_deadline_ns(deadline);
+    if(deadline >= 0)
+        mill_timer_add(&mill_running->timer, deadline, mill_running->slack,
+            mill_sync_callback);
+    mill_running->fd = -1;
+    mill_running->events = 0;
+    mill_running->deadline = deadline;
+    mill_running->syncdata.waiters = waiters;
+    mill_running->syncdata.write = write;
+    mill_running->syncdata.cancellable = cancellable;
+    mill_list_insert(waiters, &mill_running->syncdata.item, NULL);
+    mill_running->state = MILL_SYNC;
+    int rc = mill_suspend();
+    if(rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    if(deadline >= 0)
+        mill_timer_rm(&mill_running->timer);
+    return 0;
+}
+
+int mill_sync_wait(struct mill_list *waiters, int write,
+      int64_t deadline) {
+    return mill_sync_wait_(waiters, write, deadline, 1);
+}
+
+void mill_sync_wake(struct mill_list *waiters) {
+    struct mill_cr *cr = mill_cont(mill_list_begin(waiters), struct mill_cr,
+        syncdata.item);
+    mill_list_erase(waiters, &cr->syncdata.item);
+    mill_resume(cr, 0);
+}
+
+/******************************************************************************/
+/*  Mutex                                                                     */
+/******************************************************************************/
+
+mmutex mutexmake(void) {
+    struct mill_mutex *m = malloc(sizeof(struct mill_mutex));
+    if(!m) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    m->locked = 0;
+    mill_list_init(&m->waiters);
+    return m;
+}
+
+int mutexlock(mmutex m, int64_t deadline) {
+    if(mill_fast(!m->locked)) {
+        m->locked = 1;
+        return 0;
+    }
+    /* The mutex stays locked when handed over, it just changes the owner. */
+    return mill_sync_wait(&m->waiters, 0, deadline);
+}
+
+int mutextrylock(mmutex m) {
+    if(m->locked) {
+        errno = EBUSY;
+        return -1;
+    }
+    m->locked = 1;
+    return 0;
+}
+
+void mutexunlock(mmutex m) {
+    if(mill_slow(!m->locked))
+        mill_panic("unlocking a mutex that is not locked");
+    if(mill_fast(mill_list_empty(&m->waiters))) {
+        m->locked = 0;
+        return;
+    }
+    mill_sync_wake(&m->waiters);
+}
+
+void mutexclose(mmutex m) {
+    if(mill_slow(m->locked))
+        mill_panic("attempt to close a mutex that is locked");
+    free(m);
+}
+
+/******************************************************************************/
+/*  Reader-writer lock                                                        */
+/******************************************************************************/
+
+mrwlock rwlockmake(void) {
+    struct mill_rwlock *l = malloc(sizeof(struct mill_rwlock));
+    if(!l) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    l->readers = 0;
+    l->writer = 0;
+    mill_list_init(&l->waiters);
+    return l;
+}
+
+int rwlockrdlock(mrwlock l, int64_t deadline) {
+    /* Readers don't overtake waiting writers, otherwise a steady stream of
+       readers would lock the writers out forever. */
+    if(mill_fast(!l->writer && mill_list_empty(&l->waiters))) {
+        ++l->readers;
+        return 0;
+    }
+    return mill_sync_wait(&l->waiters, 0, deadline);
+}
+
+int rwlockwrlock(mrwlock l, int64_t deadline) {
+    if(mill_fast(!l->writer && !l->readers)) {
+        l->writer = 1;
+        return 0;
+    }
+    return mill_sync_wait(&l->waiters, 1, deadline);
+}
+
+void rwlockunlock(mrwlock l) {
+    if(l->writer)
+        l->writer = 0;
+    else if(mill_fast(l->readers))
+        --l->readers;
+    else
+        mill_panic("unlocking an rwlock that is not locked");
+    /* Hand the lock over either to the first writer or to all the readers
+       queued before the next writer. */
+    while(!mill_list_empty(&l->waiters)) {
+        struct mill_cr *cr = mill_cont(mill_list_begin(&l->waiters),
+            struct mill_cr, syncdata.item);
+        if(cr->syncdata.write) {
+            if(l->readers)
+                break;
+            l->writer = 1;
+            mill_sync_wake(&l->waiters);
+            break;
+        }
+        ++l->readers;
+        mill_sync_wake(&l->waiters);
+    }
+}
+
+void rwlockclose(mrwlock l) {
+    if(mill_slow(l->writer || l->readers))
+        mill_panic("attempt to close an rwlock that is locked");
+    free(l);
+}
+
+/******************************************************************************/
+/*  Semaphore                                                                 */
+/******************************************************************************/
+
+msem semmake(int value) {
+    if(mill_slow(value < 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct mill_sem *s = malloc(sizeof(struct mill_sem));
+    if(!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    s->value = value;
+    mill_list_init(&s->waiters);
+    return s;
+}
+
+int semacquire(msem s, int64_t deadline) {
+    if(mill_fast(s->value > 0)) {
+        --s->value;
+        return 0;
+    }
+    return mill_sync_wait(&s->waiters, 0, deadline);
+}
+
+void semrelease(msem s) {
+    if(mill_fast(mill_list_empty(&s->waiters))) {
+        ++s->value;
+        return;
+    }
+    /* The unit goes directly to the first waiter. */
+    mill_sync_wake(&s->waiters);
+}
+
+void semclose(msem s) {
+    if(mill_slow(!mill_list_empty(&s->waiters)))
+        mill_panic("attempt to close a semaphore while it is still being used");
+    free(s);
+}
+
+/******************************************************************************/
+/*  Condition variable                                                        */
+/******************************************************************************/
+
+mcond condmake(void) {
+    struct mill_cond *c = malloc(sizeof(struct mill_cond));
+    if(!c) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mill_list_init(&c->waiters);
+    return c;
+}
+
+int condwait(mcond c, mmutex m, int64_t deadline) {
+    mutexunlock(m);
+    int rc = mill_sync_wait(&c->waiters, 0, deadline);
+    int err = errno;
+    /* The mutex is re-acquired even if the wait failed or the coroutine was
+       cancelled. Otherwise the caller couldn't tell whether it holds it. */
+    if(m->locked)
+        mill_sync_wait_(&m->waiters, 0, -1, 0);
+    else
+        m->locked = 1;
+    errno = err;
+    return rc;
+}
+
+void condsignal(mcond c) {
+    if(!mill_list_empty(&c->waiters))
+        mill_sync_wake(&c->waiters);
+}
+
+void condbroadcast(mcond c) {
+    while(!mill_list_empty(&c->waiters))
+        mill_sync_wake(&c->waiters);
+}
+
+void condclose(mcond c) {
+    if(mill_slow(!mill_list_empty(&c->waiters)))
+        mill_panic("attempt to close a condition variable while it is still "
+            "being used");
+    free(c);
+}
+
+/******************************************************************************/
+/*  Wait group                                                                */
+/******************************************************************************/
+
+mwaitgroup waitgroupmake(void) {
+    struct mill_waitgroup *wg = malloc(sizeof(struct mill_waitgroup));
+    if(!wg) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    wg->count = 0;
+    mill_list_init(&wg->waiters);
+    return wg;
+}
+
+void waitgroupadd(mwaitgroup wg, int n) {
+    wg->count += n;
+    if(mill_slow(wg->count < 0))
+        mill_panic("wait group count dropped below zero");
+    if(wg->count == 0) {
+        while(!mill_list_empty(&wg->waiters))
+            mill_sync_wake(&wg->waiters);
+    }
+}
+
+void waitgroupdone(mwaitgroup wg) {
+    waitgroupadd(wg, -1);
+}
+
+int waitgroupwait(mwaitgroup wg, int64_t deadline) {
+    if(wg->count == 0)
+        return 0;
+    return mill_sync_wait(&wg->waiters, 0, deadline);
+}
+
+void waitgroupclose(mwaitgroup wg) {
+    if(mill_slow(!mill_list_empty(&wg->waiters)))
+        mill_panic("attempt to close a wait group while it is still being used");
+    free(wg);
+}
+
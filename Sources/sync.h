@@ -0,0 +1,63 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_SYNC_INCLUDED
+#define MILL_SYNC_INCLUDED
+
+#include <stdint.h>
+
+#include "list.h"
+
+struct mill_cr;
+
+/* One of these structures is preallocated for every coroutine. It is used
+   while the coroutine is blocked on a mutex, rwlock, semaphore or condition
+   variable. */
+struct mill_syncdata {
+    /* The coroutine is stored in this list of waiters. */
+    struct mill_list_item item;
+    /* The list the coroutine is waiting in. */
+    struct mill_list *waiters;
+    /* 1 if the coroutine wants to lock an rwlock for writing. */
+    int write;
+    /* 0 if the wait must not be cut short by gocancel(). */
+    int cancellable;
+};
+
+/* Blocks the running coroutine at the end of the list of waiters until it is
+   resumed by mill_sync_wake(), until the deadline (in milliseconds) expires
+   or until the coroutine is cancelled. Returns 0 in the first case, -1 with
+   errno set to ETIMEDOUT or ECANCELED otherwise. */
+int mill_sync_wait(struct mill_list *waiters, int write, int64_t deadline);
+
+/* Removes the first coroutine from the list of waiters and resumes it. */
+void mill_sync_wake(struct mill_list *waiters);
+
+/* Removes the coroutine from the wait list it is blocked in and resumes it.
+   The blocked call fails with 'err'. Does nothing if the coroutine is not
+   waiting for a synchronisation primitive. */
+void mill_sync_interrupt(struct mill_cr *cr, int err);
+
+#endif
+
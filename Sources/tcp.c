@@ -33,9 +33,11 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "cr.h"
 #include "debug.h"
 #include "ip.h"
 #include "libvenice.h"
+#include "poller.h"
 #include "utils.h"
 
 /* The buffer size is based on typical Ethernet MTU (1500 bytes). Making it
@@ -47,6 +49,17 @@
 #define MILL_TCP_BUFLEN (1500 - 68)
 #endif
 
+/* Maximum number of addresses tcpconnect_name() tries to connect to. */
+#ifndef MILL_TCP_MAXATTEMPTS
+#define MILL_TCP_MAXATTEMPTS 16
+#endif
+
+/* Delay between starting two subsequent connection attempts in
+ tcpconnect_name(), in milliseconds. The value is taken from RFC 8305. */
+#ifndef MILL_TCP_ATTEMPT_DELAY
+#define MILL_TCP_ATTEMPT_DELAY 250
+#endif
+
 enum mill_tcptype {
     MILL_TCPLISTENER,
     MILL_TCPCONN
@@ -212,27 +225,39 @@ tcpsock tcpaccept(tcpsock s, int64_t deadline) {
             errno = ETIMEDOUT;
             return NULL;
         }
+        if(rc < 0)
+            return NULL;
         mill_assert(rc == FDW_IN);
     }
 }
 
-tcpsock tcpconnect(ipaddr addr, int64_t deadline) {
+/* Opens a socket and connects it to the remote endpoint. Returns the file
+ descriptor or -1 in case of error. */
+static int mill_tcpconnect_fd(ipaddr addr, int64_t deadline) {
     /* Open a socket. */
     int s = socket(mill_ipfamily(addr), SOCK_STREAM, 0);
     if(s == -1)
-        return NULL;
+        return -1;
     mill_tcptune(s);
 
     /* Connect to the remote endpoint. */
     int rc = connect(s, (struct sockaddr*)&addr, mill_iplen(addr));
     if(rc != 0) {
         mill_assert(rc == -1);
-        if(errno != EINPROGRESS)
-            return NULL;
+        if(errno != EINPROGRESS) {
+            int err = errno;
+            fdclean(s);
+            close(s);
+            errno = err;
+            return -1;
+        }
         rc = fdwait(s, FDW_OUT, deadline);
-        if(rc == 0) {
-            errno = ETIMEDOUT;
-            return NULL;
+        if(rc <= 0) {
+            int err = rc == 0 ? ETIMEDOUT : errno;
+            fdclean(s);
+            close(s);
+            errno = err;
+            return -1;
         }
         int err;
         socklen_t errsz = sizeof(err);
@@ -242,16 +267,20 @@ tcpsock tcpconnect(ipaddr addr, int64_t deadline) {
             fdclean(s);
             close(s);
             errno = err;
-            return NULL;
+            return -1;
         }
         if(err != 0) {
             fdclean(s);
             close(s);
             errno = err;
-            return NULL;
+            return -1;
         }
     }
+    errno = 0;
+    return s;
+}
 
+static tcpsock mill_tcpconnect_sock(int s, ipaddr addr) {
     /* Create the object. */
     struct mill_tcpconn *conn = malloc(sizeof(struct mill_tcpconn));
     if(!conn) {
@@ -261,10 +290,139 @@ tcpsock tcpconnect(ipaddr addr, int64_t deadline) {
         return NULL;
     }
     tcpconn_init(conn, s);
+    conn->addr = addr;
     errno = 0;
     return (tcpsock)conn;
 }
 
+tcpsock tcpconnect(ipaddr addr, int64_t deadline) {
+    int s = mill_tcpconnect_fd(addr, deadline);
+    if(s == -1)
+        return NULL;
+    return mill_tcpconnect_sock(s, addr);
+}
+
+/* State shared by tcpconnect_name() and its connection attempts. */
+struct mill_tcprace {
+    /* The coroutine executing tcpconnect_name(). */
+    struct mill_cr *cr;
+    int64_t deadline;
+    /* Number of connection attempts still in progress. */
+    int pending;
+    /* Socket and address of the first successful attempt. -1 if none. */
+    int s;
+    ipaddr addr;
+    /* Error of the last failed attempt. */
+    int err;
+    /* Set once tcpconnect_name() has settled the result. Attempts that end
+       afterwards were interrupted and their errors are irrelevant. */
+    int over;
+};
+
+struct mill_tcpattempt {
+    struct mill_tcprace *race;
+    ipaddr addr;
+    /* The coroutine executing the attempt. */
+    struct mill_cr *cr;
+    /* 1 if the attempt has finished, 0 otherwise. */
+    int done;
+};
+
+static void mill_tcpattempt(void *arg) {
+    struct mill_tcpattempt *a = (struct mill_tcpattempt*)arg;
+    struct mill_tcprace *race = a->race;
+    a->cr = mill_running;
+    int s = mill_tcpconnect_fd(a->addr, race->deadline);
+    int err = errno;
+    a->done = 1;
+    --race->pending;
+    if(s >= 0) {
+        if(race->s < 0) {
+            race->s = s;
+            race->addr = a->addr;
+        }
+        else {
+            /* Somebody else was faster. */
+            fdclean(s);
+            close(s);
+        }
+    }
+    else if(!race->over) {
+        race->err = err;
+    }
+    /* Let tcpconnect_name() know that the attempt is over. */
+    mill_fdwait_interrupt(race->cr);
+}
+
+tcpsock tcpconnect_name(const char *name, int port, int64_t deadline) {
+    ipaddr addrs[MILL_TCP_MAXATTEMPTS];
+    int naddrs = mill_ipremotes(name, port, IPADDR_PREF_IPV6, deadline,
+        addrs, MILL_TCP_MAXATTEMPTS);
+    if(!naddrs)
+        return NULL;
+    struct mill_tcprace race;
+    race.cr = mill_running;
+    race.deadline = deadline;
+    race.pending = 0;
+    race.s = -1;
+    race.err = ECONNREFUSED;
+    race.over = 0;
+    /* Start a new connection attempt each time an attempt fails or each
+       MILL_TCP_ATTEMPT_DELAY milliseconds, whichever comes first. The first
+       attempt to succeed wins. */
+    struct mill_tcpattempt attempts[MILL_TCP_MAXATTEMPTS];
+    int nattempts = 0;
+    while(1) {
+        if(race.s >= 0 || (!race.pending && nattempts == naddrs))
+            break;
+        if(nattempts < naddrs) {
+            struct mill_tcpattempt *a = &attempts[nattempts++];
+            a->race = &race;
+            a->addr = addrs[nattempts - 1];
+            a->cr = NULL;
+            a->done = 0;
+            ++race.pending;
+            co(a, mill_tcpattempt, "tcpconnect_name");
+        }
+        if(deadline >= 0 && now() >= deadline) {
+            race.err = ETIMEDOUT;
+            break;
+        }
+        int64_t ddline = deadline;
+        if(nattempts < naddrs) {
+            ddline = now() + MILL_TCP_ATTEMPT_DELAY;
+            if(deadline >= 0 && deadline < ddline)
+                ddline = deadline;
+        }
+        int rc = fdwait(-1, 0, ddline);
+        if(rc == 0 && ddline == deadline) {
+            race.err = ETIMEDOUT;
+            break;
+        }
+        if(rc < 0 && errno == ECANCELED) {
+            race.err = ECANCELED;
+            break;
+        }
+    }
+    /* Cancel the attempts that are still in progress and wait for them
+       to close their sockets. They are all runnable at this point, so
+       yielding is enough, even if this coroutine was cancelled and can't
+       block any more. */
+    race.over = 1;
+    int i;
+    for(i = 0; i != nattempts; ++i) {
+        if(!attempts[i].done)
+            mill_fdwait_interrupt(attempts[i].cr);
+    }
+    while(race.pending)
+        mill_yield("tcpconnect_name");
+    if(race.s < 0) {
+        errno = race.err;
+        return NULL;
+    }
+    return mill_tcpconnect_sock(race.s, race.addr);
+}
+
 size_t tcpsend(tcpsock s, const void *buf, size_t len, int64_t deadline) {
     if(s->type != MILL_TCPCONN)
         mill_panic("trying to send to an unconnected socket");
@@ -305,6 +463,8 @@ size_t tcpsend(tcpsock s, const void *buf, size_t len, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return len - remaining;
             }
+            if(rc < 0)
+                return len - remaining;
             mill_assert(rc == FDW_OUT);
             continue;
         }
@@ -334,6 +494,8 @@ void tcpflush(tcpsock s, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return;
             }
+            if(rc < 0)
+                return;
             mill_assert(rc == FDW_OUT);
             continue;
         }
@@ -423,6 +585,8 @@ size_t tcprecv(tcpsock s, void *buf, size_t len, int64_t deadline) {
             errno = ETIMEDOUT;
             return len - remaining;
         }
+        if(res < 0)
+            return len - remaining;
     }
 }
 
@@ -527,6 +691,8 @@ size_t tcprecvlh(tcpsock s, void *buf, size_t lowwater, size_t highwater, int64_
             errno = ETIMEDOUT;
             return received;
         }
+        if(res < 0)
+            return received;
     }
 }
 
@@ -23,6 +23,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -35,117 +36,338 @@ static mach_timebase_info_data_t mill_mtid = {0};
 #include "timer.h"
 #include "utils.h"
 
-/* 1 millisecond expressed in CPU ticks. The value is chosen is such a way that
- it works reasonably well for CPU frequencies above 500MHz. On significanly
- slower machines you may wish to reconsider. */
-#define MILL_CLOCK_PRECISION 1000000
+#if (defined __GNUC__ || defined __clang__) && \
+(defined __i386__ || defined __x86_64__)
+#include <cpuid.h>
+#define MILL_TSC
+#elif (defined __GNUC__ || defined __clang__) && defined __aarch64__
+#define MILL_CNTVCT
+#endif
 
-/* Returns current time by querying the operating system. */
-static int64_t mill_now(void) {
+/* For how many nanoseconds the TSC is measured against the system clock to
+ find out its frequency. */
+#ifndef MILL_CLOCK_CALIBRATION
+#define MILL_CLOCK_CALIBRATION 10000000
+#endif
+
+/* How often, in nanoseconds, the counter is re-anchored to the system
+ clock. Must be well below 4s, otherwise the conversion of counter ticks
+ to nanoseconds may overflow. */
+#define MILL_CLOCK_ANCHOR 1000000000
+
+int64_t now_ns(void) {
 #if defined __APPLE__
     if (mill_slow(!mill_mtid.denom))
         mach_timebase_info(&mill_mtid);
     uint64_t ticks = mach_absolute_time();
-    return (int64_t)(ticks * mill_mtid.numer / mill_mtid.denom / 1000000);
+    return (int64_t)(ticks * mill_mtid.numer / mill_mtid.denom);
 #elif defined CLOCK_MONOTONIC
     struct timespec ts;
     int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
     mill_assert (rc == 0);
-    return ((int64_t)ts.tv_sec) * 1000 + (((int64_t)ts.tv_nsec) / 1000000);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
 #else
     struct timeval tv;
     int rc = gettimeofday(&tv, NULL);
-    assert(rc == 0);
-    return ((int64_t)tv.tv_sec) * 1000 + (((int64_t)tv.tv_usec) / 1000);
+    mill_assert(rc == 0);
+    return ((int64_t)tv.tv_sec) * 1000000000 + ((int64_t)tv.tv_usec) * 1000;
 #endif
 }
 
-int64_t now(void) {
-#if (defined __GNUC__ || defined __clang__) && \
-(defined __i386__ || defined __x86_64__)
-    /* Get the timestamp counter. This is time since startup, expressed in CPU
-     cycles. Unlike gettimeofday() or similar function, it's extremely fast -
-     it takes only few CPU cycles to evaluate. */
+/* Returns current time by querying the operating system. */
+static int64_t mill_now(void) {
+    return now_ns() / 1000000;
+}
+
+#if defined MILL_TSC || defined MILL_CNTVCT
+
+/* Reads the CPU counter. Unlike clock_gettime() or similar functions, it's
+ extremely fast - it takes only few CPU cycles to evaluate. */
+static inline uint64_t mill_counter(void) {
+#if defined MILL_TSC
     uint32_t low;
     uint32_t high;
     __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
-    int64_t tsc = (int64_t)((uint64_t)high << 32 | low);
-    /* These global variables are used to hold the last seen timestamp counter
-     and last seen time measurement. We'll initilise them the first time
-     this function is called. */
-    static int64_t last_tsc = -1;
-    static int64_t last_now = -1;
-    if(mill_slow(last_tsc < 0)) {
-        last_tsc = tsc;
-        last_now = mill_now();
+    return (uint64_t)high << 32 | low;
+#else
+    uint64_t cnt;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r" (cnt));
+    return cnt;
+#endif
+}
+
+/* Counter frequency, expressed as nanoseconds per tick in 32.32 fixed point
+ format. Zero if not yet known. */
+static uint64_t mill_clock_mult = 0;
+/* Number of ticks after which the counter has to be re-anchored. */
+static uint64_t mill_clock_max = 0;
+/* Last reading of the counter matched with the system clock. */
+static uint64_t mill_clock_tick = 0;
+static int64_t mill_clock_ns = -1;
+
+/* Matches the counter with the system clock. When the counter runs long
+ enough since the previous anchor, the frequency estimate is refined. */
+static void mill_clock_anchor(uint64_t tick) {
+    int64_t ns = now_ns();
+    if(mill_clock_ns >= 0 && tick > mill_clock_tick) {
+        int64_t elapsed = ns - mill_clock_ns;
+        /* Don't risk overflow if we were not called for a long time. */
+        if(elapsed >= MILL_CLOCK_CALIBRATION &&
+              elapsed < 2 * MILL_CLOCK_ANCHOR) {
+#if defined MILL_TSC
+            mill_clock_mult = ((uint64_t)elapsed << 32) /
+                (tick - mill_clock_tick);
+            mill_clock_max = ((uint64_t)MILL_CLOCK_ANCHOR << 32) /
+                mill_clock_mult;
+#endif
+        }
+        else if(elapsed < MILL_CLOCK_CALIBRATION && !mill_clock_mult)
+            return;
     }
-    /* If TSC haven't jumped back or progressed more than 1/2 ms, we can use
-     the cached time value. */
-    if(mill_fast(tsc - last_tsc <= (MILL_CLOCK_PRECISION / 2) &&
-                 tsc >= last_tsc))
-        return last_now;
-    /* It's more than 1/2 ms since we've last measured the time.
-     We'll do a new measurement now. */
-    last_tsc = tsc;
-    last_now = mill_now();
-    return last_now;
+    mill_clock_tick = tick;
+    mill_clock_ns = ns;
+}
+
+/* Returns 1 if the counter ticks at a constant rate and is synchronised
+ among CPUs, 0 otherwise. */
+static int mill_clock_init(void) {
+#if defined MILL_TSC
+    /* Invariant TSC is reported by CPUID leaf 0x80000007, EDX bit 8. */
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return 0;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        return 0;
+#else
+    /* Generic timer has a fixed frequency reported by the CPU. */
+    uint64_t freq;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    if(!freq)
+        return 0;
+    mill_clock_mult = (1000000000ULL << 32) / freq;
+    mill_clock_max = ((uint64_t)MILL_CLOCK_ANCHOR << 32) / mill_clock_mult;
+#endif
+    mill_clock_anchor(mill_counter());
+    return 1;
+}
+
+#endif
+
+int64_t now(void) {
+    /* Never return less than before, even though re-anchoring may move
+     the clock slightly backwards. */
+    static int64_t last_now = 0;
+    int64_t nw;
+#if defined MILL_TSC || defined MILL_CNTVCT
+    /* 1 if the CPU counter can be used, 0 if it can't, -1 if we don't know
+     yet. */
+    static int counter = -1;
+    if(mill_slow(counter < 0))
+        counter = mill_clock_init();
+    if(mill_fast(counter)) {
+        uint64_t tick = mill_counter();
+        /* Until the TSC frequency is known, ask the system for the time. */
+        if(mill_slow(!mill_clock_mult)) {
+            mill_clock_anchor(tick);
+            nw = mill_now();
+        }
+        else {
+            if(mill_slow(tick < mill_clock_tick ||
+                  tick - mill_clock_tick > mill_clock_max))
+                mill_clock_anchor(tick);
+            nw = (mill_clock_ns + (int64_t)(((tick - mill_clock_tick) *
+                mill_clock_mult) >> 32)) / 1000000;
+        }
+        if(mill_slow(nw < last_now))
+            return last_now;
+        last_now = nw;
+        return nw;
+    }
+#endif
+#if defined CLOCK_MONOTONIC_COARSE
+    /* Coarse clock is only as precise as the kernel tick, but it is cheap
+     to read and it shares the timeline with now_ns(). */
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    mill_assert(rc == 0);
+    nw = ((int64_t)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
 #else
-    return mill_now();
+    nw = mill_now();
 #endif
+    if(mill_slow(nw < last_now))
+        return last_now;
+    last_now = nw;
+    return nw;
+}
+
+/* Binary min-heap of timers, ordered by key and sequence number. */
+static struct mill_timer **mill_timers = NULL;
+static size_t mill_ntimers = 0;
+static size_t mill_timers_capacity = 0;
+static uint64_t mill_timers_seq = 0;
+
+/* Returns 1 if timer 'a' should fire before timer 'b'. */
+static int mill_timer_before(struct mill_timer *a, struct mill_timer *b) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+/* Put the timer at the specified 0-based position in the heap. */
+static void mill_timer_place(struct mill_timer *timer, size_t pos) {
+    mill_timers[pos] = timer;
+    timer->idx = pos + 1;
+}
+
+static void mill_timer_siftup(struct mill_timer *timer) {
+    size_t pos = timer->idx - 1;
+    while(pos) {
+        size_t parent = (pos - 1) / 2;
+        if(!mill_timer_before(timer, mill_timers[parent]))
+            break;
+        mill_timer_place(mill_timers[parent], pos);
+        pos = parent;
+    }
+    mill_timer_place(timer, pos);
+}
+
+static void mill_timer_siftdown(struct mill_timer *timer) {
+    size_t pos = timer->idx - 1;
+    while(1) {
+        size_t child = pos * 2 + 1;
+        if(child >= mill_ntimers)
+            break;
+        if(child + 1 < mill_ntimers &&
+              mill_timer_before(mill_timers[child + 1], mill_timers[child]))
+            ++child;
+        if(!mill_timer_before(mill_timers[child], timer))
+            break;
+        mill_timer_place(mill_timers[child], pos);
+        pos = child;
+    }
+    mill_timer_place(timer, pos);
 }
 
-/* Global linked list of all timers. The list is ordered.
- First timer to be resume comes first and so on. */
-static struct mill_list mill_timers = {0};
+/* Remove the timer from the heap. */
+static void mill_timer_erase(struct mill_timer *timer) {
+    size_t pos = timer->idx - 1;
+    timer->idx = 0;
+    --mill_ntimers;
+    if(pos == mill_ntimers)
+        return;
+    struct mill_timer *last = mill_timers[mill_ntimers];
+    mill_timer_place(last, pos);
+    if(pos && mill_timer_before(last, mill_timers[(pos - 1) / 2]))
+        mill_timer_siftup(last);
+    else
+        mill_timer_siftdown(last);
+}
+
+/* Drop disarmed timers from the top of the heap and move the timers that
+ were re-added with later deadlines to their proper positions. Returns the
+ first timer to expire or NULL if there are no timers. */
+static struct mill_timer *mill_timer_top(void) {
+    while(mill_ntimers) {
+        struct mill_timer *tm = mill_timers[0];
+        if(!tm->armed)
+            mill_timer_erase(tm);
+        else if(tm->key < tm->expiry) {
+            tm->key = tm->expiry;
+            tm->seq = mill_timers_seq++;
+            mill_timer_siftdown(tm);
+        }
+        else
+            return tm;
+    }
+    return NULL;
+}
+
+void mill_timer_init(struct mill_timer *timer) {
+    timer->idx = 0;
+    timer->armed = 0;
+}
+
+void mill_timer_term(struct mill_timer *timer) {
+    if(timer->idx)
+        mill_timer_erase(timer);
+    timer->armed = 0;
+}
 
 void mill_timer_add(struct mill_timer *timer, int64_t deadline,
-                    mill_timer_callback callback) {
+                    int64_t slack, mill_timer_callback callback) {
     mill_assert(deadline >= 0);
+    mill_assert(!timer->armed);
+    /* Round the deadline up to a multiple of the largest power of two that
+     fits into the slack. Timers with nearby deadlines thus end up with
+     the same expiry and get fired together. */
+    if(slack > 0) {
+        int64_t granularity = 1;
+        while(granularity <= slack / 2)
+            granularity *= 2;
+        if(deadline <= INT64_MAX - granularity)
+            deadline = (deadline + granularity - 1) & ~(granularity - 1);
+    }
     timer->expiry = deadline;
     timer->callback = callback;
-    /* Move the timer into the right place in the ordered list
-     of existing timers. TODO: This is an O(n) operation! */
-    struct mill_list_item *it = mill_list_begin(&mill_timers);
-    while(it) {
-        struct mill_timer *tm = mill_cont(it, struct mill_timer, item);
-        /* If multiple timers expire at the same momemt they will be fired
-         in the order they were created in (> rather than >=). */
-        if(tm->expiry > timer->expiry)
-            break;
-        it = mill_list_next(it);
+    timer->armed = 1;
+    /* If the timer is still in the heap with an earlier key, leave it there.
+     It will be moved once it gets to the top. */
+    if(timer->idx) {
+        if(timer->key > deadline) {
+            timer->key = deadline;
+            timer->seq = mill_timers_seq++;
+            mill_timer_siftup(timer);
+        }
+        return;
+    }
+    if(mill_slow(mill_ntimers == mill_timers_capacity)) {
+        mill_timers_capacity = mill_timers_capacity ?
+            mill_timers_capacity * 2 : 64;
+        mill_timers = realloc(mill_timers,
+            mill_timers_capacity * sizeof(struct mill_timer*));
+        mill_assert(mill_timers);
     }
-    mill_list_insert(&mill_timers, &timer->item, it);
+    timer->key = deadline;
+    timer->seq = mill_timers_seq++;
+    timer->idx = ++mill_ntimers;
+    mill_timer_siftup(timer);
 }
 
 void mill_timer_rm(struct mill_timer *timer) {
-    mill_list_erase(&mill_timers, &timer->item);
+    timer->armed = 0;
 }
 
-int mill_timer_next(void) {
-    if(mill_list_empty(&mill_timers))
+int64_t mill_timer_next(void) {
+    struct mill_timer *tm = mill_timer_top();
+    if(!tm)
         return -1;
-    int64_t nw = now();
-    int64_t expiry = mill_cont(mill_list_begin(&mill_timers),
-                               struct mill_timer, item)->expiry;
-    return (int) (nw >= expiry ? 0 : expiry - nw);
+    int64_t nw = now_ns();
+    return nw >= tm->expiry ? 0 : tm->expiry - nw;
+}
+
+int64_t mill_deadline_ns(int64_t deadline) {
+    if(deadline < 0)
+        return -1;
+    /* Deadlines too far in the future to be expressed in nanoseconds are
+     as good as infinite. */
+    if(deadline > INT64_MAX / 1000000)
+        return INT64_MAX;
+    return deadline * 1000000;
 }
 
 int mill_timer_fire(void) {
     /* Avoid getting current time if there are no timers anyway. */
-    if(mill_list_empty(&mill_timers))
+    if(!mill_ntimers)
         return 0;
-    int64_t nw = now();
+    int64_t nw = now_ns();
     int fired = 0;
-    while(!mill_list_empty(&mill_timers)) {
-        struct mill_timer *tm = mill_cont(
-                                          mill_list_begin(&mill_timers), struct mill_timer, item);
-        if(tm->expiry > nw)
+    while(1) {
+        struct mill_timer *tm = mill_timer_top();
+        if(!tm || tm->expiry > nw)
             break;
-        mill_list_erase(&mill_timers, mill_list_begin(&mill_timers));
+        mill_timer_erase(tm);
+        tm->armed = 0;
         if(tm->callback)
             tm->callback(tm);
         fired = 1;
     }
     return fired;
 }
-
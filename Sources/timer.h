@@ -25,33 +25,56 @@
 #ifndef MILL_TIMER_INCLUDED
 #define MILL_TIMER_INCLUDED
 
+#include <stddef.h>
 #include <stdint.h>
 
-#include "list.h"
-
 struct mill_timer;
 
 typedef void (*mill_timer_callback)(struct mill_timer *timer);
 
+/* Timers are kept in a binary heap. Removing a timer only disarms it;
+ it is dropped from the heap once it gets to the top. A disarmed timer that
+ is added again while still in the heap with an earlier key doesn't have
+ to be moved at all. */
 struct mill_timer {
-    /* Item in the global list of all timers. */
-    struct mill_list_item item;
-    /* The deadline when the timer expires. */
+    /* The deadline when the timer expires, in nanoseconds. */
     int64_t expiry;
+    /* Position of the timer in the heap. May be less than 'expiry' if the
+     timer was re-added without being moved in the heap. */
+    int64_t key;
+    /* Timers with the same key fire in the order they were added in. */
+    uint64_t seq;
+    /* 1-based index in the heap, 0 if the timer is not in the heap. */
+    size_t idx;
+    /* 1 if the timer is waiting to expire. */
+    int armed;
     /* Callback invoked when timer expires. Pfui Teufel! */
     mill_timer_callback callback;
 };
 
-/* Add a timer for the running coroutine. */
+/* Initialise the timer. Must be called before the timer is first used. */
+void mill_timer_init(struct mill_timer *timer);
+
+/* Remove the timer from the heap for good. Must be called before
+ the memory of the timer is released. */
+void mill_timer_term(struct mill_timer *timer);
+
+/* Add a timer for the running coroutine. Deadline is in nanoseconds.
+ The timer may fire up to 'slack' nanoseconds late. That allows timers
+ with nearby deadlines to be fired together. */
 void mill_timer_add(struct mill_timer *timer, int64_t deadline,
-                    mill_timer_callback callback);
+                    int64_t slack, mill_timer_callback callback);
 
 /* Remove the timer associated with the running coroutine. */
 void mill_timer_rm(struct mill_timer *timer);
 
-/* Number of milliseconds till the next timer expires.
+/* Number of nanoseconds till the next timer expires.
  If there are no timers returns -1. */
-int mill_timer_next(void);
+int64_t mill_timer_next(void);
+
+/* Converts deadline in milliseconds, as returned by now(), to nanoseconds,
+ as returned by now_ns(). Negative deadline (no deadline) is kept as is. */
+int64_t mill_deadline_ns(int64_t deadline);
 
 /* Resumes all coroutines whose timers have already expired.
  Returns zero if no coroutine was resumed, 1 otherwise. */
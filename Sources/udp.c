@@ -127,6 +127,8 @@ size_t udprecv(udpsock s, ipaddr *addr, void *buf, size_t len,
             errno = ETIMEDOUT;
             return 0;
         }
+        if(rc < 0)
+            return 0;
     }
     errno = 0;
     return (size_t)ss;
@@ -22,6 +22,10 @@
 
 */
 
+#if defined __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
@@ -29,6 +33,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -40,9 +45,26 @@
 #define MILL_UNIX_BUFLEN (4096)
 #endif
 
+/* Maximum interval, in milliseconds, between connection attempts while
+   the listener's backlog is full. */
+#ifndef MILL_UNIX_BACKOFF
+#define MILL_UNIX_BACKOFF (64)
+#endif
+
+/* Maximum number of messages unixrecvmmsg() receives in one go. */
+#ifndef MILL_UNIX_MAXMSGS
+#define MILL_UNIX_MAXMSGS (64)
+#endif
+
+/* Maximum number of file descriptors passed in a single message. */
+#ifndef MILL_UNIX_MAXFDS
+#define MILL_UNIX_MAXFDS (64)
+#endif
+
 enum mill_unixtype {
    MILL_UNIXLISTENER,
-   MILL_UNIXCONN
+   MILL_UNIXCONN,
+   MILL_UNIXMSG
 };
 
 struct mill_unixsock {
@@ -52,6 +74,8 @@ struct mill_unixsock {
 struct mill_unixlistener {
     struct mill_unixsock sock;
     int fd;
+    /* SOCK_STREAM or SOCK_SEQPACKET. */
+    int socktype;
 };
 
 struct mill_unixconn {
@@ -62,6 +86,21 @@ struct mill_unixconn {
     size_t olen;
     char ibuf[MILL_UNIX_BUFLEN];
     char obuf[MILL_UNIX_BUFLEN];
+    /* File descriptors received from the peer but not yet claimed by
+       unixrecvfds(). */
+    int *fds;
+    size_t nfds;
+    /* Set when the kernel had to discard some of the file descriptors sent
+       by the peer. Reported by the next unixrecvfds(). */
+    int fdslost;
+};
+
+/* Message-oriented socket, either SOCK_SEQPACKET or SOCK_DGRAM. Messages are
+   framed by the kernel so there's no buffering in user space. */
+struct mill_unixmsg {
+    struct mill_unixsock sock;
+    int fd;
+    int socktype;
 };
 
 static void mill_unixtune(int s) {
@@ -80,14 +119,32 @@ static void mill_unixtune(int s) {
 #endif
 }
 
-static int mill_unixresolve(const char *addr, struct sockaddr_un *su) {
+/* Converts the address to sockaddr_un. Addresses starting with '@' are
+   in the Linux abstract namespace and don't touch the filesystem. */
+static int mill_unixresolve(const char *addr, struct sockaddr_un *su,
+      socklen_t *sulen) {
     mill_assert(su);
-    if (strlen(addr) >= sizeof(su->sun_path)) {
+    size_t len = strlen(addr);
+    if (len >= sizeof(su->sun_path)) {
         errno = EINVAL;
         return -1;
     }
+    memset(su, 0, sizeof(struct sockaddr_un));
     su->sun_family = AF_UNIX;
+    if(addr[0] == '@') {
+#if defined __linux__
+        /* The name is not null-terminated; the length says where it ends. */
+        memcpy(su->sun_path + 1, addr + 1, len - 1);
+        *sulen = offsetof(struct sockaddr_un, sun_path) + len;
+        errno = 0;
+        return 0;
+#else
+        errno = EINVAL;
+        return -1;
+#endif
+    }
     strncpy(su->sun_path, addr, sizeof(su->sun_path));
+    *sulen = sizeof(struct sockaddr_un);
     errno = 0;
     return 0;
 }
@@ -98,42 +155,148 @@ static void unixconn_init(struct mill_unixconn *conn, int fd) {
     conn->ifirst = 0;
     conn->ilen = 0;
     conn->olen = 0;
+    conn->fds = NULL;
+    conn->nfds = 0;
+    conn->fdslost = 0;
 }
 
-unixsock unixlisten(const char *addr, int backlog) {
+/* Closes the file descriptors nobody has claimed. */
+static void unixconn_term(struct mill_unixconn *conn) {
+    size_t i;
+    for(i = 0; i != conn->nfds; ++i)
+        close(conn->fds[i]);
+    free(conn->fds);
+}
+
+/* Passed file descriptors travel attached to a single marker byte inserted
+   into the stream by unixsendfds(). This function works like recv() except
+   that it strips the marker bytes from the data and queues the file
+   descriptors that came with them. The kernel ends a read at the data the
+   file descriptors are attached to, so the marker is always the last byte. */
+static ssize_t mill_unixread(struct mill_unixconn *conn, void *buf,
+      size_t len) {
+    while(1) {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int) * MILL_UNIX_MAXFDS)];
+        } ctrl;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+        ssize_t sz = recvmsg(conn->fd, &msg, flags);
+        if(sz <= 0)
+            return sz;
+        /* The control buffer was too small for what the peer sent. The data
+           is fine but the file descriptors that didn't fit are gone. */
+        if(mill_slow(msg.msg_flags & MSG_CTRUNC))
+            conn->fdslost = 1;
+        struct cmsghdr *cmsg;
+        int marker = 0;
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            marker = 1;
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = realloc(conn->fds, (conn->nfds + n) * sizeof(int));
+            if(mill_slow(!fds)) {
+                /* There's nowhere to store the file descriptors. Drop them
+                   rather than leak them. */
+                size_t i;
+                for(i = 0; i != n; ++i)
+                    close(((int*)CMSG_DATA(cmsg))[i]);
+                continue;
+            }
+            memcpy(&fds[conn->nfds], CMSG_DATA(cmsg), n * sizeof(int));
+            conn->fds = fds;
+            conn->nfds += n;
+        }
+        if(marker)
+            --sz;
+        if(sz > 0)
+            return sz;
+        /* There was nothing but the marker. Try again. */
+    }
+}
+
+/* Opens a socket of the specified type bound to the address. Stream and
+   seqpacket sockets are put into listening mode. Returns the file
+   descriptor or -1 in case of error. */
+static int mill_unixlisten_fd(const char *addr, int socktype, int backlog) {
     struct sockaddr_un su;
-    int rc = mill_unixresolve(addr, &su);
+    socklen_t sulen;
+    int rc = mill_unixresolve(addr, &su, &sulen);
     if (rc != 0) {
-        return NULL;
+        return -1;
     }
     /* Open the listening socket. */
-    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    int s = socket(AF_UNIX, socktype, 0);
     if(s == -1)
-        return NULL;
+        return -1;
     mill_unixtune(s);
 
     /* Start listening. */
-    rc = bind(s, (struct sockaddr*)&su, sizeof(struct sockaddr_un));
-    if(rc != 0)
-        return NULL;
-    rc = listen(s, backlog);
-    if(rc != 0)
-        return NULL;
+    rc = bind(s, (struct sockaddr*)&su, sulen);
+    if(rc == 0 && socktype != SOCK_DGRAM)
+        rc = listen(s, backlog);
+    if(rc != 0) {
+        int err = errno;
+        fdclean(s);
+        close(s);
+        errno = err;
+        return -1;
+    }
+    return s;
+}
 
-    /* Create the object. */
+static unixsock mill_unixlistener_make(int s, int socktype) {
     struct mill_unixlistener *l = malloc(sizeof(struct mill_unixlistener));
     if(!l) {
-        fdclean(s);
-        close(s);
         errno = ENOMEM;
         return NULL;
     }
     l->sock.type = MILL_UNIXLISTENER;
     l->fd = s;
+    l->socktype = socktype;
     errno = 0;
     return &l->sock;
 }
 
+static unixsock mill_unixmsg_make(int s, int socktype) {
+    struct mill_unixmsg *m = malloc(sizeof(struct mill_unixmsg));
+    if(!m) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    m->sock.type = MILL_UNIXMSG;
+    m->fd = s;
+    m->socktype = socktype;
+    errno = 0;
+    return &m->sock;
+}
+
+unixsock unixlisten(const char *addr, int backlog) {
+    int s = mill_unixlisten_fd(addr, SOCK_STREAM, backlog);
+    if(s == -1)
+        return NULL;
+    unixsock l = mill_unixlistener_make(s, SOCK_STREAM);
+    if(!l) {
+        fdclean(s);
+        close(s);
+        errno = ENOMEM;
+    }
+    return l;
+}
+
 unixsock unixaccept(unixsock s, int64_t deadline) {
     if(s->type != MILL_UNIXLISTENER)
         mill_panic("trying to accept on a socket that isn't listening");
@@ -141,6 +304,16 @@ unixsock unixaccept(unixsock s, int64_t deadline) {
     while(1) {
         /* Try to get new connection (non-blocking). */
         int as = accept(l->fd, NULL, NULL);
+        if (as >= 0 && l->socktype == SOCK_SEQPACKET) {
+            mill_unixtune(as);
+            unixsock m = mill_unixmsg_make(as, SOCK_SEQPACKET);
+            if(!m) {
+                fdclean(as);
+                close(as);
+                errno = ENOMEM;
+            }
+            return m;
+        }
         if (as >= 0) {
             mill_unixtune(as);
             struct mill_unixconn *conn = malloc(sizeof(struct mill_unixconn));
@@ -163,33 +336,83 @@ unixsock unixaccept(unixsock s, int64_t deadline) {
             errno = ETIMEDOUT;
             return NULL;
         }
+        if(rc < 0)
+            return NULL;
         mill_assert(rc == FDW_IN);
     }
 }
 
-unixsock unixconnect(const char *addr) {
+/* Opens a socket of the specified type and connects it to the address.
+   Returns the file descriptor or -1 in case of error. */
+static int mill_unixconnect_fd(const char *addr, int socktype,
+      int64_t deadline) {
     struct sockaddr_un su;
-    int rc = mill_unixresolve(addr, &su);
+    socklen_t sulen;
+    int rc = mill_unixresolve(addr, &su, &sulen);
     if (rc != 0) {
-        return NULL;
+        return -1;
     }
 
     /* Open a socket. */
-    int s = socket(AF_UNIX,  SOCK_STREAM, 0);
+    int s = socket(AF_UNIX, socktype, 0);
     if(s == -1)
-        return NULL;
+        return -1;
     mill_unixtune(s);
 
     /* Connect to the remote endpoint. */
-    rc = connect(s, (struct sockaddr*)&su, sizeof(struct sockaddr_un));
-    if(rc != 0) {
-        int err = errno;
+    int64_t backoff = 1;
+    while(1) {
+        rc = connect(s, (struct sockaddr*)&su, sulen);
+        if(rc == 0)
+            break;
         mill_assert(rc == -1);
+        int err = errno;
+        if(err == EINPROGRESS) {
+            /* The connection is being established asynchronously. */
+            rc = fdwait(s, FDW_OUT, deadline);
+            if(rc <= 0) {
+                err = rc == 0 ? ETIMEDOUT : errno;
+            }
+            else {
+                socklen_t errsz = sizeof(err);
+                rc = getsockopt(s, SOL_SOCKET, SO_ERROR, (void*)&err, &errsz);
+                if(rc != 0)
+                    err = errno;
+                if(err == 0)
+                    break;
+            }
+        }
+        else if(err == EAGAIN || err == EWOULDBLOCK) {
+            /* The listener's backlog is full. Linux doesn't queue
+               the attempt in this case, so back off for a while and
+               try again. */
+            int64_t nw = now();
+            if(deadline >= 0 && nw >= deadline) {
+                err = ETIMEDOUT;
+            }
+            else {
+                int64_t ddline = nw + backoff;
+                if(deadline >= 0 && deadline < ddline)
+                    ddline = deadline;
+                if(backoff < MILL_UNIX_BACKOFF)
+                    backoff *= 2;
+                if(fdwait(-1, 0, ddline) >= 0)
+                    continue;
+                err = errno;
+            }
+        }
         fdclean(s);
         close(s);
         errno = err;
-        return NULL;
+        return -1;
     }
+    return s;
+}
+
+unixsock unixconnect(const char *addr, int64_t deadline) {
+    int s = mill_unixconnect_fd(addr, SOCK_STREAM, deadline);
+    if(s == -1)
+        return NULL;
 
     /* Create the object. */
     struct mill_unixconn *conn = malloc(sizeof(struct mill_unixconn));
@@ -281,6 +504,8 @@ size_t unixsend(unixsock s, const void *buf, size_t len, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return len - remaining;
             }
+            if(rc < 0)
+                return len - remaining;
             mill_assert(rc == FDW_OUT);
             continue;
         }
@@ -310,6 +535,8 @@ void unixflush(unixsock s, int64_t deadline) {
                 errno = ETIMEDOUT;
                 return;
             }
+            if(rc < 0)
+                return;
             mill_assert(rc == FDW_OUT);
             continue;
         }
@@ -347,7 +574,7 @@ size_t unixrecv(unixsock s, void *buf, size_t len, int64_t deadline) {
         if(remaining > MILL_UNIX_BUFLEN) {
             /* If we still have a lot to read try to read it in one go directly
                into the destination buffer. */
-            ssize_t sz = recv(conn->fd, pos, remaining, 0);
+            ssize_t sz = mill_unixread(conn, pos, remaining);
             if(!sz) {
                 errno = ECONNRESET;
                 return len - remaining;
@@ -367,7 +594,7 @@ size_t unixrecv(unixsock s, void *buf, size_t len, int64_t deadline) {
         else {
             /* If we have just a little to read try to read the full connection
                buffer to minimise the number of system calls. */
-            ssize_t sz = recv(conn->fd, conn->ibuf, MILL_UNIX_BUFLEN, 0);
+            ssize_t sz = mill_unixread(conn, conn->ibuf, MILL_UNIX_BUFLEN);
             if(!sz) {
                 errno = ECONNRESET;
                 return len - remaining;
@@ -399,6 +626,8 @@ size_t unixrecv(unixsock s, void *buf, size_t len, int64_t deadline) {
             errno = ETIMEDOUT;
             return len - remaining;
         }
+        if(res < 0)
+            return len - remaining;
     }
 }
 
@@ -423,6 +652,343 @@ size_t unixrecvuntil(unixsock s, void *buf, size_t len,
     return len;
 }
 
+int unixsendfds(unixsock s, const int *fds, int nfds, int64_t deadline) {
+    if(s->type != MILL_UNIXCONN)
+        mill_panic("trying to send to an unconnected socket");
+    struct mill_unixconn *conn = (struct mill_unixconn*)s;
+    if(nfds <= 0 || nfds > MILL_UNIX_MAXFDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Data sent before the file descriptors must reach the peer first. */
+    unixflush(s, deadline);
+    if(errno != 0)
+        return -1;
+    char marker = 0;
+    struct iovec iov;
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * MILL_UNIX_MAXFDS)];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    while(1) {
+        ssize_t sz = sendmsg(conn->fd, &msg, 0);
+        if(sz == 1) {
+            errno = 0;
+            return 0;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        int rc = fdwait(conn->fd, FDW_OUT, deadline);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc < 0)
+            return -1;
+        mill_assert(rc == FDW_OUT);
+    }
+}
+
+int unixsendfd(unixsock s, int fd, int64_t deadline) {
+    return unixsendfds(s, &fd, 1, deadline);
+}
+
+int unixrecvfds(unixsock s, int *fds, int maxfds, int64_t deadline) {
+    if(s->type != MILL_UNIXCONN)
+        mill_panic("trying to receive from an unconnected socket");
+    struct mill_unixconn *conn = (struct mill_unixconn*)s;
+    if(maxfds <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Read until some file descriptors arrive. The data preceding them is
+       stored in the input buffer for subsequent unixrecv() calls. */
+    while(!conn->nfds && !conn->fdslost) {
+        if(conn->ifirst) {
+            memmove(conn->ibuf, &conn->ibuf[conn->ifirst], conn->ilen);
+            conn->ifirst = 0;
+        }
+        if(conn->ilen == MILL_UNIX_BUFLEN) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        ssize_t sz = mill_unixread(conn, &conn->ibuf[conn->ilen],
+            MILL_UNIX_BUFLEN - conn->ilen);
+        if(!sz) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if(sz > 0) {
+            conn->ilen += sz;
+            continue;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        int rc = fdwait(conn->fd, FDW_IN, deadline);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc < 0)
+            return -1;
+    }
+    /* If some file descriptors were lost return those that did arrive but
+       report the loss. */
+    int lost = conn->fdslost;
+    conn->fdslost = 0;
+    if(!conn->nfds) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    int n = conn->nfds < (size_t)maxfds ? (int)conn->nfds : maxfds;
+    memcpy(fds, conn->fds, n * sizeof(int));
+    conn->nfds -= n;
+    memmove(conn->fds, &conn->fds[n], conn->nfds * sizeof(int));
+    errno = lost ? EMSGSIZE : 0;
+    return n;
+}
+
+int unixrecvfd(unixsock s, int64_t deadline) {
+    int fd;
+    if(unixrecvfds(s, &fd, 1, deadline) < 0)
+        return -1;
+    return fd;
+}
+
+static int mill_unixsocktype(int type) {
+    switch(type) {
+    case UNIX_SEQPACKET:
+        return SOCK_SEQPACKET;
+    case UNIX_DGRAM:
+        return SOCK_DGRAM;
+    default:
+        return -1;
+    }
+}
+
+/* A UNIX_DGRAM listener is receive-only. Sockets created by unixmsgconnect()
+   aren't bound to an address, so there's nowhere to send a reply to and
+   unixsendmsg() on the listener fails with ENOTCONN. Peers that need replies
+   should use UNIX_SEQPACKET, or a unixmsgpair() passed over the socket. */
+unixsock unixmsglisten(const char *addr, int type, int backlog) {
+    int socktype = mill_unixsocktype(type);
+    if(socktype < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int s = mill_unixlisten_fd(addr, socktype, backlog);
+    if(s == -1)
+        return NULL;
+    /* Datagram sockets don't accept connections; they receive directly. */
+    unixsock l = socktype == SOCK_DGRAM ? mill_unixmsg_make(s, socktype) :
+        mill_unixlistener_make(s, socktype);
+    if(!l) {
+        fdclean(s);
+        close(s);
+        errno = ENOMEM;
+    }
+    return l;
+}
+
+unixsock unixmsgconnect(const char *addr, int type, int64_t deadline) {
+    int socktype = mill_unixsocktype(type);
+    if(socktype < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int s = mill_unixconnect_fd(addr, socktype, deadline);
+    if(s == -1)
+        return NULL;
+    unixsock m = mill_unixmsg_make(s, socktype);
+    if(!m) {
+        fdclean(s);
+        close(s);
+        errno = ENOMEM;
+    }
+    return m;
+}
+
+void unixmsgpair(int type, unixsock *a, unixsock *b) {
+    int socktype = mill_unixsocktype(type);
+    if(!a || !b || socktype < 0) {
+        errno = EINVAL;
+        return;
+    }
+    int fd[2];
+    int rc = socketpair(AF_UNIX, socktype, 0, fd);
+    if (rc != 0)
+        return;
+    mill_unixtune(fd[0]);
+    mill_unixtune(fd[1]);
+    *a = mill_unixmsg_make(fd[0], socktype);
+    *b = *a ? mill_unixmsg_make(fd[1], socktype) : NULL;
+    if(!*b) {
+        free(*a);
+        fdclean(fd[0]);
+        close(fd[0]);
+        fdclean(fd[1]);
+        close(fd[1]);
+        errno = ENOMEM;
+        return;
+    }
+    errno = 0;
+}
+
+size_t unixsendmsg(unixsock s, const void *buf, size_t len,
+      int64_t deadline) {
+    if(s->type != MILL_UNIXMSG)
+        mill_panic("trying to send a message to a stream socket");
+    struct mill_unixmsg *m = (struct mill_unixmsg*)s;
+    while(1) {
+        ssize_t sz = send(m->fd, buf, len, 0);
+        if(sz >= 0) {
+            errno = 0;
+            return len;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+        int rc = fdwait(m->fd, FDW_OUT, deadline);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if(rc < 0)
+            return 0;
+    }
+}
+
+/* Fills in the header for receiving a message into the buffer. */
+static void mill_unixmsghdr(struct msghdr *hdr, struct iovec *iov) {
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+}
+
+size_t unixrecvmsg(unixsock s, void *buf, size_t len, int64_t deadline) {
+    if(s->type != MILL_UNIXMSG)
+        mill_panic("trying to receive a message from a stream socket");
+    struct mill_unixmsg *m = (struct mill_unixmsg*)s;
+    while(1) {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        struct msghdr hdr;
+        mill_unixmsghdr(&hdr, &iov);
+        ssize_t sz = recvmsg(m->fd, &hdr, 0);
+        if(sz >= 0) {
+            /* Zero-sized read from a connection means the peer has closed
+               it. Datagrams, on the other hand, can be empty. */
+            if(!sz && m->socktype == SOCK_SEQPACKET)
+                errno = ECONNRESET;
+            else if(hdr.msg_flags & MSG_TRUNC)
+                errno = EMSGSIZE;
+            else
+                errno = 0;
+            return (size_t)sz;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+        int rc = fdwait(m->fd, FDW_IN, deadline);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if(rc < 0)
+            return 0;
+    }
+}
+
+/* Receives up to nmsgs messages into the buffers described by msgs. The
+   array itself is not modified; the size of each message is stored in the
+   corresponding element of lens. */
+int unixrecvmmsg(unixsock s, const struct iovec *msgs, size_t *lens,
+      int nmsgs, int64_t deadline) {
+    if(s->type != MILL_UNIXMSG)
+        mill_panic("trying to receive a message from a stream socket");
+    struct mill_unixmsg *m = (struct mill_unixmsg*)s;
+    if(!lens || nmsgs <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(nmsgs > MILL_UNIX_MAXMSGS)
+        nmsgs = MILL_UNIX_MAXMSGS;
+    int trunc = 0;
+    int i;
+    while(1) {
+        int n;
+#if defined __linux__
+        /* Get all the messages that are already queued in one go. */
+        struct mmsghdr hdrs[MILL_UNIX_MAXMSGS];
+        struct iovec iovs[MILL_UNIX_MAXMSGS];
+        for(i = 0; i != nmsgs; ++i) {
+            iovs[i] = msgs[i];
+            mill_unixmsghdr(&hdrs[i].msg_hdr, &iovs[i]);
+            hdrs[i].msg_len = 0;
+        }
+        n = recvmmsg(m->fd, hdrs, nmsgs, 0, NULL);
+        for(i = 0; i < n; ++i) {
+            lens[i] = hdrs[i].msg_len;
+            if(hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                trunc = 1;
+        }
+#else
+        for(n = 0; n != nmsgs; ++n) {
+            struct msghdr hdr;
+            struct iovec iov = msgs[n];
+            mill_unixmsghdr(&hdr, &iov);
+            ssize_t sz = recvmsg(m->fd, &hdr, 0);
+            if(sz < 0)
+                break;
+            lens[n] = sz;
+            if(hdr.msg_flags & MSG_TRUNC)
+                trunc = 1;
+        }
+        if(!n)
+            n = -1;
+#endif
+        if(n > 0) {
+            if(m->socktype == SOCK_SEQPACKET) {
+                /* Once the peer closes the connection every read returns
+                   zero bytes. Return the messages preceding the first such
+                   read and report the closure on the next call. */
+                for(i = 0; i != n; ++i)
+                    if(!lens[i])
+                        break;
+                if(!i) {
+                    errno = ECONNRESET;
+                    return -1;
+                }
+                n = i;
+            }
+            errno = trunc ? EMSGSIZE : 0;
+            return n;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        int rc = fdwait(m->fd, FDW_IN, deadline);
+        if(rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(rc < 0)
+            return -1;
+    }
+}
+
 void unixclose(unixsock s) {
     if(s->type == MILL_UNIXLISTENER) {
         struct mill_unixlistener *l = (struct mill_unixlistener*)s;
@@ -434,16 +1000,31 @@ void unixclose(unixsock s) {
     }
     if(s->type == MILL_UNIXCONN) {
         struct mill_unixconn *c = (struct mill_unixconn*)s;
+        unixconn_term(c);
         fdclean(c->fd);
         int rc = close(c->fd);
         mill_assert(rc == 0);
         free(c);
         return;
     }
+    if(s->type == MILL_UNIXMSG) {
+        struct mill_unixmsg *m = (struct mill_unixmsg*)s;
+        fdclean(m->fd);
+        int rc = close(m->fd);
+        mill_assert(rc == 0);
+        free(m);
+        return;
+    }
     mill_assert(0);
 }
 
 unixsock unixattach(int fd, int listening) {
+    int socktype;
+    socklen_t optsz = sizeof(socktype);
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &socktype, &optsz) != 0)
+        socktype = SOCK_STREAM;
+    if(socktype == SOCK_DGRAM || (socktype == SOCK_SEQPACKET && !listening))
+        return mill_unixmsg_make(fd, socktype);
     if(listening == 0) {
         struct mill_unixconn *conn = malloc(sizeof(struct mill_unixconn));
         if(!conn) {
@@ -454,15 +1035,7 @@ unixsock unixattach(int fd, int listening) {
         errno = 0;
         return (unixsock)conn;
     }
-    struct mill_unixlistener *l = malloc(sizeof(struct mill_unixlistener));
-    if(!l) {
-        errno = ENOMEM;
-        return NULL;
-    }
-    l->sock.type = MILL_UNIXLISTENER;
-    l->fd = fd;
-    errno = 0;
-    return &l->sock;
+    return mill_unixlistener_make(fd, socktype);
 }
 
 int unixdetach(unixsock s) {
@@ -474,6 +1047,12 @@ int unixdetach(unixsock s) {
     }
     if(s->type == MILL_UNIXCONN) {
         int fd = ((struct mill_unixconn*)s)->fd;
+        unixconn_term((struct mill_unixconn*)s);
+        free(s);
+        return fd;
+    }
+    if(s->type == MILL_UNIXMSG) {
+        int fd = ((struct mill_unixmsg*)s)->fd;
         free(s);
         return fd;
     }
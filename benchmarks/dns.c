@@ -0,0 +1,184 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Measures how long N concurrent ipremote() calls take when every answer
+   from the DNS server is delayed. With resolvers working in parallel the
+   total should be close to a single delay rather than N of them.
+
+   The benchmark runs its own stub DNS server in a child process. The stub
+   listens on 127.0.0.1:53, so /etc/resolv.conf has to point to 127.0.0.1
+   and the benchmark needs the privilege to bind the port. It answers every
+   A query with 127.0.0.1 and every other query with an empty answer.
+
+   Build and run from the Sources directory:
+
+       clang -O2 -I. ../benchmarks/dns.c *.c -lpthread -o dns
+       ./dns [lookups] [delay-ms] */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libvenice.h"
+
+#define DNS_MAXMSG 512
+
+static int lookups = 100;
+static int64_t delay = 100;
+
+/******************************************************************************/
+/*  Stub DNS server                                                           */
+/******************************************************************************/
+
+struct query {
+    udpsock s;
+    ipaddr addr;
+    size_t len;
+    unsigned char buf[DNS_MAXMSG];
+};
+
+static void answer(void *arg) {
+    struct query *q = arg;
+    mill_msleep(now() + delay, "answer");
+    /* Find the end of the question. */
+    size_t pos = 12;
+    while(pos < q->len && q->buf[pos])
+        pos += q->buf[pos] + 1;
+    pos += 5;
+    if(pos > q->len) {
+        free(q);
+        return;
+    }
+    int a = q->buf[pos - 4] == 0 && q->buf[pos - 3] == 1;
+    /* Turn the query into a response, keeping the question. */
+    q->buf[2] = 0x81;
+    q->buf[3] = 0x80;
+    q->buf[6] = 0;
+    q->buf[7] = a ? 1 : 0;
+    memset(&q->buf[8], 0, 4);
+    if(a) {
+        static const unsigned char rr[] = {
+            0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c,
+            0x00, 0x04, 127, 0, 0, 1};
+        memcpy(&q->buf[pos], rr, sizeof(rr));
+        pos += sizeof(rr);
+    }
+    udpsend(q->s, q->addr, q->buf, pos);
+    free(q);
+}
+
+static void stub(void) {
+    udpsock s = udplisten(iplocal("127.0.0.1", 53, IPADDR_IPV4));
+    if(!s) {
+        perror("cannot bind 127.0.0.1:53");
+        exit(1);
+    }
+    while(1) {
+        struct query *q = malloc(sizeof(struct query));
+        if(!q) {
+            perror("malloc");
+            exit(1);
+        }
+        q->s = s;
+        q->len = udprecv(s, &q->addr, q->buf, sizeof(q->buf), -1);
+        if(q->len < 12) {
+            free(q);
+            continue;
+        }
+        co(q, answer, "answer");
+    }
+}
+
+/******************************************************************************/
+/*  Client                                                                    */
+/******************************************************************************/
+
+static int generation = 0;
+static int failures = 0;
+
+static void lookup(void *arg) {
+    char name[64];
+    snprintf(name, sizeof(name), "h%ld-%d.bench.test", (long)arg, generation);
+    ipremote(name, 80, IPADDR_IPV4, -1);
+    if(errno != 0)
+        ++failures;
+}
+
+static void report(const char *name, int n, int64_t start) {
+    int64_t duration = now() - start;
+    printf("%-12s %6d lookups %8ld ms %8.2f delays\n", name, n,
+        (long)duration, (double)duration / delay);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        lookups = atoi(argv[1]);
+    if(argc > 2)
+        delay = atol(argv[2]);
+    if(lookups <= 0 || delay <= 0) {
+        fprintf(stderr, "usage: dns [lookups] [delay-ms]\n");
+        return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = mfork();
+    if(pid < 0) {
+        perror("mfork");
+        return 1;
+    }
+    if(pid == 0) {
+        stub();
+        return 0;
+    }
+    /* Give the stub time to bind the port. */
+    mill_msleep(now() + 100, "main");
+
+    /* Each generation uses fresh names so that nothing is served from the
+       cache. */
+    ++generation;
+    int sequential = lookups < 10 ? lookups : 10;
+    int64_t start = now();
+    long i;
+    for(i = 0; i != sequential; ++i)
+        lookup((void*)i);
+    report("sequential", sequential, start);
+
+    ++generation;
+    mwaitgroup wg = waitgroupmake();
+    start = now();
+    for(i = 0; i != lookups; ++i)
+        cogroup((void*)i, lookup, wg, "lookup");
+    waitgroupwait(wg, -1);
+    report("concurrent", lookups, start);
+    waitgroupclose(wg);
+
+    if(failures)
+        printf("%d lookups failed\n", failures);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Compares mmutex with the emulation of a mutex by a channel with a buffer
+   of one holding a single token: chr() acquires the lock, chs() releases it.
+
+   Build and run from the Sources directory:
+
+       clang -O2 -I. ../benchmarks/mutex.c *.c -lpthread -o mutex
+       ./mutex [iterations] [coroutines]
+
+   The uncontended case locks and unlocks in a loop from a single coroutine.
+   In the contended case every coroutine yields while holding the lock, so
+   all the others queue up behind it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libvenice.h"
+
+static long iterations = 10000000;
+static int ncoroutines = 16;
+
+static mmutex mtx;
+static chan token;
+
+static void mutexworker(void *arg) {
+    long n = (long)arg;
+    long i;
+    for(i = 0; i != n; ++i) {
+        mutexlock(mtx, -1);
+        mill_yield("mutexworker");
+        mutexunlock(mtx);
+    }
+}
+
+static void chanworker(void *arg) {
+    long n = (long)arg;
+    long i;
+    for(i = 0; i != n; ++i) {
+        mill_chr(token, "chanworker");
+        mill_yield("chanworker");
+        mill_chs(token, "chanworker");
+    }
+}
+
+static void report(const char *name, long ops, int64_t start) {
+    int64_t duration = now() - start;
+    if(duration <= 0)
+        duration = 1;
+    printf("%-24s %10ld ops %8ld ms %10.2f ns/op\n", name, ops,
+        (long)duration, (double)duration * 1000000.0 / ops);
+}
+
+static void contended(const char *name, void (*worker)(void*), long ops) {
+    mwaitgroup wg = waitgroupmake();
+    long per = ops / ncoroutines;
+    int64_t start = now();
+    int i;
+    for(i = 0; i != ncoroutines; ++i)
+        cogroup((void*)per, worker, wg, name);
+    waitgroupwait(wg, -1);
+    report(name, per * ncoroutines, start);
+    waitgroupclose(wg);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1)
+        iterations = atol(argv[1]);
+    if(argc > 2)
+        ncoroutines = atoi(argv[2]);
+    if(iterations <= 0 || ncoroutines <= 0) {
+        fprintf(stderr, "usage: mutex [iterations] [coroutines]\n");
+        return 1;
+    }
+
+    mtx = mutexmake();
+    token = mill_chmake(1, "token");
+    mill_chs(token, "token");
+
+    long i;
+    int64_t start = now();
+    for(i = 0; i != iterations; ++i) {
+        mutexlock(mtx, -1);
+        mutexunlock(mtx);
+    }
+    report("uncontended mutex", iterations, start);
+
+    start = now();
+    for(i = 0; i != iterations; ++i) {
+        mill_chr(token, "main");
+        mill_chs(token, "main");
+    }
+    report("uncontended chan token", iterations, start);
+
+    /* Every contended operation involves a context switch. */
+    contended("contended mutex", mutexworker, iterations / 10);
+    contended("contended chan token", chanworker, iterations / 10);
+
+    mutexclose(mtx);
+    mill_chclose(token, "token");
+    return 0;
+}